@@ -0,0 +1,560 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+    Microbenchmarks for each stage of the key detection pipeline.
+
+    Build with "make -f Makefile.linux bench" from the top directory,
+    then run bench/keydetector-bench, optionally with a substring to
+    select benchmarks by name and with --isa=scalar, --isa=sse2 or
+    --isa=avx2 to force the kernels for one instruction set. Each
+    benchmark is run on a synthetic
+    signal at 44.1, 48 and 96 kHz and reports the time per hop, the
+    realtime factor (seconds of audio processed per second of CPU
+    time) and the number of heap allocations per hop.
+
+    With --precision, instead compare the reduced-precision chroma
+    history options against double precision, reporting the working
+    memory of each and how closely its output matches.
+
+    With --parallel, instead compare analyseBufferParallel() against
+    analyseBuffer() for each method, rate and a range of thread
+    counts, reporting the number of hops whose keys disagree and the
+    largest difference in key strength.
+
+    With --input, instead compare process(const float *) against
+    process(const double *) on the same samples for each method and
+    rate, reporting how many hops agree on the key and the largest
+    difference in key strength.
+*/
+
+#include "keydetector/KeyDetector.h"
+#include "src/ChromaFrontEnd.h"
+#include "src/Kernels.h"
+#include "src/KeyDetectorQM.h"
+#include "src/KeyDetectorDaschuer.h"
+#include "vamp/KeyDetectorPlugin.h"
+
+#include "dsp/rateconversion/Decimator.h"
+#include "dsp/chromagram/Chromagram.h"
+#include "base/Pitch.h"
+#include "maths/MathUtilities.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+// Count every heap allocation made while a benchmark is running
+
+static size_t allocationCount = 0;
+
+void *operator new(size_t size)
+{
+    ++allocationCount;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    ++allocationCount;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+using namespace KD;
+
+namespace {
+
+const double kSignalSeconds = 30.0;
+const double kMinBenchSeconds = 0.5;
+
+// A slow progression of triads with a little noise, enough to
+// exercise every part of the key estimation
+std::vector<float>
+makeSignal(double sampleRate)
+{
+    size_t n = size_t(kSignalSeconds * sampleRate);
+    std::vector<float> signal(n);
+    const int roots[] = { 48, 53, 55, 48 };
+    const int third[] = { 4, 4, 4, 3 };
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < n; ++i) {
+        double t = double(i) / sampleRate;
+        int chord = int(t / 2.0) % 4;
+        double v = 0;
+        int pitches[] = { roots[chord], roots[chord] + third[chord],
+                          roots[chord] + 7, roots[chord] + 12 };
+        for (int p = 0; p < 4; ++p) {
+            double f = Pitch::getFrequencyForPitch(pitches[p]);
+            v += 0.2 * sin(2.0 * M_PI * f * t);
+        }
+        seed = seed * 1103515245u + 12345u;
+        v += 0.02 * (double((seed >> 16) & 0x7fff) / 16384.0 - 1.0);
+        signal[i] = float(v);
+    }
+
+    return signal;
+}
+
+struct Context {
+    double sampleRate;
+    int blockSize;
+    int hopSize;
+    std::vector<float> signal;
+    std::vector<double> signalDouble;
+    std::vector<double> chroma; // unit-max chroma per hop, made on demand
+    int hops;
+};
+
+struct Result {
+    int hops;
+    double seconds;
+    Result(int h, double s) : hops(h), seconds(s) { }
+};
+
+class Timer
+{
+public:
+    Timer() : m_start(std::chrono::steady_clock::now()) { }
+    double elapsed() const {
+        return std::chrono::duration<double>
+            (std::chrono::steady_clock::now() - m_start).count();
+    }
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// A benchmark sets itself up, then processes hops [0, hops) of the
+// context's signal once, timing only the processing loop
+typedef Result (*BenchFunction)(Context &);
+
+Result
+benchDecimator(Context &c)
+{
+    // The first (or only) stage of the front end's decimation
+    ChromaFrontEnd fe(ChromaFrontEnd::Config(c.sampleRate));
+    int factor = fe.getDecimationFactor();
+    if (factor > Decimator::getHighestSupportedFactor()) {
+        factor = Decimator::getHighestSupportedFactor();
+    }
+    if (factor < 2) {
+        return Result(0, 0);
+    }
+    Decimator decimator(c.blockSize, factor);
+    std::vector<double> out(c.blockSize / factor);
+    allocationCount = 0;
+    Timer timer;
+    for (int h = 0; h < c.hops; ++h) {
+        decimator.process(&c.signalDouble[size_t(h) * c.hopSize], out.data());
+    }
+    return Result(c.hops, timer.elapsed());
+}
+
+ChromaConfig
+makeChromaConfig(double sampleRate, int decimationFactor)
+{
+    ChromaConfig cconfig;
+    cconfig.normalise = MathUtilities::NormaliseUnitMax;
+    cconfig.FS = sampleRate / decimationFactor;
+    cconfig.min = Pitch::getFrequencyForPitch(48, 0, 440.0);
+    cconfig.max = Pitch::getFrequencyForPitch(96, 0, 440.0);
+    cconfig.BPO = 36;
+    cconfig.CQThresh = 0.0054;
+    return cconfig;
+}
+
+Result
+benchChromagram(Context &c)
+{
+    ChromaFrontEnd fe(ChromaFrontEnd::Config(c.sampleRate));
+    int factor = fe.getDecimationFactor();
+    Chromagram chroma(makeChromaConfig(c.sampleRate, factor));
+    int frameSize = chroma.getFrameSize();
+    std::vector<double> decimated(frameSize);
+    for (int i = 0; i < frameSize; ++i) {
+        decimated[i] = c.signalDouble[size_t(i) * factor];
+    }
+    allocationCount = 0;
+    Timer timer;
+    for (int h = 0; h < c.hops; ++h) {
+        chroma.process(decimated.data());
+    }
+    return Result(c.hops, timer.elapsed());
+}
+
+// Chroma vectors for every hop, for the post-chroma benchmarks
+const std::vector<double> &
+getChroma(Context &c)
+{
+    if (c.chroma.empty()) {
+        ChromaFrontEnd::Config fconfig(c.sampleRate);
+        fconfig.normalise = MathUtilities::NormaliseUnitMax;
+        ChromaFrontEnd fe(fconfig);
+        int bins = fe.getBinsPerOctave();
+        c.chroma.resize(size_t(c.hops) * bins);
+        for (int h = 0; h < c.hops; ++h) {
+            const double *out = fe.process(&c.signal[size_t(h) * c.hopSize]);
+            memcpy(&c.chroma[size_t(h) * bins], out, bins * sizeof(double));
+        }
+    }
+    return c.chroma;
+}
+
+Result
+benchQMKeyEstimation(Context &c)
+{
+    const std::vector<double> &chroma = getChroma(c);
+    KeyDetectorQM kd(KeyDetectorQM::Config(c.sampleRate));
+    allocationCount = 0;
+    Timer timer;
+    for (int h = 0; h < c.hops; ++h) {
+        kd.processChroma(&chroma[size_t(h) * 36]);
+    }
+    return Result(c.hops, timer.elapsed());
+}
+
+Result
+benchQMProcess(Context &c)
+{
+    KeyDetectorQM kd(KeyDetectorQM::Config(c.sampleRate));
+    allocationCount = 0;
+    Timer timer;
+    for (int h = 0; h < c.hops; ++h) {
+        kd.process(&c.signal[size_t(h) * c.hopSize]);
+    }
+    return Result(c.hops, timer.elapsed());
+}
+
+Result
+benchDaschuerProcess(Context &c)
+{
+    KeyDetectorDaschuer kd(KeyDetectorDaschuer::Config(c.sampleRate));
+    allocationCount = 0;
+    Timer timer;
+    for (int h = 0; h < c.hops; ++h) {
+        kd.process(&c.signal[size_t(h) * c.hopSize]);
+    }
+    return Result(c.hops, timer.elapsed());
+}
+
+Result
+benchPluginProcess(Context &c)
+{
+    KeyDetectorPlugin plugin(float(c.sampleRate));
+    if (!plugin.initialise(1, c.hopSize, c.blockSize)) {
+        return Result(0, 0);
+    }
+    allocationCount = 0;
+    Timer timer;
+    for (int h = 0; h < c.hops; ++h) {
+        const float *buffers[1] = { &c.signal[size_t(h) * c.hopSize] };
+        plugin.process(buffers, Vamp::RealTime::frame2RealTime
+                       (long(h) * c.hopSize, (unsigned int)c.sampleRate));
+    }
+    return Result(c.hops, timer.elapsed());
+}
+
+void
+comparePrecisions()
+{
+    const double sampleRate = 44100.0;
+    std::vector<float> signal = makeSignal(sampleRate);
+
+    const KeyDetector::Precision precisions[] = {
+        KeyDetector::PRECISION_DOUBLE,
+        KeyDetector::PRECISION_FLOAT,
+        KeyDetector::PRECISION_FIXED16
+    };
+    const char *names[] = { "double", "float", "fixed16" };
+
+    printf("%-10s %14s %14s %14s\n", "Precision", "memory (bytes)",
+           "keys agreeing", "max strength");
+    printf("%-10s %14s %14s %14s\n", "", "", "with double", "difference");
+    printf("%s\n", std::string(55, '-').c_str());
+
+    KeyDetector::Analysis reference;
+
+    for (int p = 0; p < 3; ++p) {
+        KeyDetector::Config config(KeyDetector::METHOD_QM, sampleRate);
+        config.precision = precisions[p];
+        KeyDetector kd(config);
+        KeyDetector::Analysis analysis =
+            kd.analyseBuffer(signal.data(), signal.size());
+        if (p == 0) {
+            reference = analysis;
+        }
+
+        size_t agreeing = 0;
+        for (size_t i = 0; i < analysis.keys.size(); ++i) {
+            if (analysis.keys[i] == reference.keys[i]) ++agreeing;
+        }
+        double maxDiff = 0.0;
+        for (size_t i = 0; i < analysis.keyStrengths.size(); ++i) {
+            double diff = fabs(analysis.keyStrengths[i] -
+                               reference.keyStrengths[i]);
+            if (diff > maxDiff) maxDiff = diff;
+        }
+
+        printf("%-10s %14zu %13.2f%% %14.2e\n", names[p],
+               kd.getWorkingMemorySize(),
+               100.0 * double(agreeing) / double(analysis.keys.size()),
+               maxDiff);
+    }
+}
+
+void
+compareInputPrecisions()
+{
+    const double rates[] = { 44100.0, 48000.0, 96000.0 };
+    const char *methods[] = { "qm", "daschuer" };
+
+    printf("%-10s %8s %8s %14s %14s\n", "Method", "rate", "hops",
+           "keys agreeing", "max strength");
+    printf("%-10s %8s %8s %14s %14s\n", "", "", "",
+           "with double", "difference");
+    printf("%s\n", std::string(58, '-').c_str());
+
+    for (int m = 0; m < 2; ++m) {
+        for (size_t r = 0; r < sizeof(rates)/sizeof(rates[0]); ++r) {
+
+            // The same sample values in each precision, so that only
+            // the processing differs
+            std::vector<float> signal = makeSignal(rates[r]);
+            std::vector<double> signalDouble(signal.begin(), signal.end());
+
+            KeyDetector::Config config(KeyDetector::Method(m), rates[r]);
+            KeyDetector kdDouble(config);
+            KeyDetector kdFloat(config);
+
+            const size_t blockSize = kdDouble.getBlockSize();
+            const size_t hopSize = kdDouble.getHopSize();
+
+            double strengthsDouble[24], strengthsFloat[24];
+            size_t hops = 0, agreeing = 0;
+            double maxDiff = 0.0;
+
+            for (size_t offset = 0; offset + blockSize <= signal.size();
+                 offset += hopSize) {
+                int keyDouble = kdDouble.process(&signalDouble[offset]);
+                int keyFloat = kdFloat.process(&signal[offset]);
+                if (keyDouble == keyFloat) ++agreeing;
+                kdDouble.getKeyStrengths(strengthsDouble);
+                kdFloat.getKeyStrengths(strengthsFloat);
+                for (int i = 0; i < 24; ++i) {
+                    double diff = fabs(strengthsDouble[i] - strengthsFloat[i]);
+                    if (diff > maxDiff) maxDiff = diff;
+                }
+                ++hops;
+            }
+
+            printf("%-10s %8d %8zu %13.2f%% %14.2e\n", methods[m],
+                   int(rates[r]), hops,
+                   hops ? 100.0 * double(agreeing) / double(hops) : 100.0,
+                   maxDiff);
+        }
+    }
+}
+
+// Return false if any keys disagree
+bool
+compareParallel()
+{
+    const double rates[] = { 44100.0, 48000.0, 96000.0 };
+    const int threadCounts[] = { 2, 4, 8 };
+    const char *methods[] = { "qm", "daschuer" };
+
+    printf("%-10s %8s %8s %8s %14s %14s\n", "Method", "rate", "threads",
+           "hops", "keys", "max strength");
+    printf("%-10s %8s %8s %8s %14s %14s\n", "", "", "", "",
+           "disagreeing", "difference");
+    printf("%s\n", std::string(67, '-').c_str());
+
+    int disagreements = 0;
+
+    for (int m = 0; m < 2; ++m) {
+        for (size_t r = 0; r < sizeof(rates)/sizeof(rates[0]); ++r) {
+
+            std::vector<float> signal = makeSignal(rates[r]);
+            KeyDetector::Config config(KeyDetector::Method(m), rates[r]);
+
+            KeyDetector serial(config);
+            KeyDetector::Analysis reference =
+                serial.analyseBuffer(signal.data(), signal.size());
+
+            for (size_t t = 0;
+                 t < sizeof(threadCounts)/sizeof(threadCounts[0]); ++t) {
+
+                KeyDetector parallel(config);
+                KeyDetector::Analysis analysis =
+                    parallel.analyseBufferParallel
+                    (signal.data(), signal.size(), threadCounts[t]);
+
+                size_t disagreeing = 0;
+                if (analysis.keys.size() != reference.keys.size()) {
+                    disagreeing = reference.keys.size();
+                } else {
+                    for (size_t i = 0; i < analysis.keys.size(); ++i) {
+                        if (analysis.keys[i] != reference.keys[i]) {
+                            ++disagreeing;
+                        }
+                    }
+                }
+                if (analysis.globalKey != reference.globalKey) {
+                    ++disagreeing;
+                }
+                double maxDiff = 0.0;
+                for (size_t i = 0; i < analysis.keyStrengths.size() &&
+                         i < reference.keyStrengths.size(); ++i) {
+                    double diff = fabs(analysis.keyStrengths[i] -
+                                       reference.keyStrengths[i]);
+                    if (diff > maxDiff) maxDiff = diff;
+                }
+
+                printf("%-10s %8d %8d %8zu %14zu %14.2e\n", methods[m],
+                       int(rates[r]), threadCounts[t], reference.keys.size(),
+                       disagreeing, maxDiff);
+
+                disagreements += int(disagreeing);
+            }
+        }
+    }
+
+    printf("\n%s\n", disagreements == 0 ? "Parallel and serial keys agree" :
+           "Parallel and serial keys DISAGREE");
+
+    return disagreements == 0;
+}
+
+struct Benchmark {
+    const char *name;
+    BenchFunction function;
+};
+
+const Benchmark benchmarks[] = {
+    { "Decimator::process", benchDecimator },
+    { "Chromagram::process", benchChromagram },
+    { "KeyDetectorQM::processChroma", benchQMKeyEstimation },
+    { "KeyDetectorQM::process", benchQMProcess },
+    { "KeyDetectorDaschuer::process", benchDaschuerProcess },
+    { "KeyDetectorPlugin::process", benchPluginProcess },
+};
+
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string filter;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--precision") {
+            comparePrecisions();
+            return 0;
+        } else if (arg == "--input") {
+            compareInputPrecisions();
+            return 0;
+        } else if (arg == "--parallel") {
+            return compareParallel() ? 0 : 1;
+        } else if (arg.find("--isa=") == 0) {
+            std::string isa = arg.substr(6);
+            KeyDetector::InstructionSet set = KeyDetector::INSTRUCTIONS_AUTO;
+            if (isa == "scalar") set = KeyDetector::INSTRUCTIONS_SCALAR;
+            else if (isa == "sse2") set = KeyDetector::INSTRUCTIONS_SSE2;
+            else if (isa == "avx2") set = KeyDetector::INSTRUCTIONS_AVX2;
+            if (set == KeyDetector::INSTRUCTIONS_AUTO ||
+                !KeyDetector::setInstructionSet(set)) {
+                fprintf(stderr, "Instruction set %s not supported\n",
+                        isa.c_str());
+                return 1;
+            }
+        } else {
+            filter = arg;
+        }
+    }
+
+    const double rates[] = { 44100.0, 48000.0, 96000.0 };
+
+    printf("Kernels: %s\n\n", Kernels::getInstructionSetName());
+
+    printf("%-40s %12s %12s %12s\n",
+           "Benchmark", "ns/hop", "x realtime", "allocs/hop");
+    printf("%s\n", std::string(79, '-').c_str());
+
+    for (size_t r = 0; r < sizeof(rates)/sizeof(rates[0]); ++r) {
+
+        std::string suffix = "/" + std::to_string(int(rates[r]));
+        bool wanted = false;
+        for (size_t b = 0; b < sizeof(benchmarks)/sizeof(benchmarks[0]); ++b) {
+            std::string name = benchmarks[b].name + suffix;
+            if (name.find(filter) != std::string::npos) {
+                wanted = true;
+            }
+        }
+        if (!wanted) {
+            continue;
+        }
+
+        Context c;
+        c.sampleRate = rates[r];
+        KeyDetector::Config config(KeyDetector::METHOD_QM, c.sampleRate);
+        KeyDetector::getBlockAndHopSize(config, c.blockSize, c.hopSize);
+        c.signal = makeSignal(c.sampleRate);
+        c.signalDouble.assign(c.signal.begin(), c.signal.end());
+        c.hops = int((c.signal.size() - c.blockSize) / c.hopSize);
+
+        for (size_t b = 0; b < sizeof(benchmarks)/sizeof(benchmarks[0]); ++b) {
+
+            std::string name = benchmarks[b].name + suffix;
+            if (name.find(filter) == std::string::npos) {
+                continue;
+            }
+
+            // Repeat until we have a reasonably stable measurement
+            double seconds = 0;
+            long hops = 0;
+            size_t allocations = 0;
+
+            while (seconds < kMinBenchSeconds) {
+                Result result = benchmarks[b].function(c);
+                allocations += allocationCount;
+                if (result.hops == 0) break;
+                seconds += result.seconds;
+                hops += result.hops;
+            }
+
+            if (hops == 0) {
+                printf("%-40s %12s\n", name.c_str(), "failed");
+                continue;
+            }
+
+            double nsPerHop = seconds * 1e9 / double(hops);
+            double audioSeconds = double(hops) * c.hopSize / c.sampleRate;
+
+            printf("%-40s %12.0f %12.1f %12.2f\n", name.c_str(), nsPerHop,
+                   audioSeconds / seconds, double(allocations) / double(hops));
+        }
+    }
+
+    return 0;
+}
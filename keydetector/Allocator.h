@@ -0,0 +1,47 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_ALLOCATOR_H
+#define KEY_DETECTOR_ALLOCATOR_H
+
+#include <cstddef>
+
+namespace KD {
+
+/**
+ * Source of memory for a detector's working buffers. Each detector
+ * makes a single allocation for all of its per-instance buffers, and
+ * another only if it is reconfigured to need more space, so an
+ * implementation can place detectors in huge pages or NUMA-local
+ * memory without having to be fast.
+ *
+ * The allocator must outlive every detector that uses it. It may be
+ * called from any thread that constructs, reconfigures or destroys a
+ * detector.
+ */
+class Allocator
+{
+public:
+    virtual ~Allocator() { }
+
+    /**
+     * Return at least size bytes aligned to alignment, which is a
+     * power of two, or throw std::bad_alloc.
+     */
+    virtual void *allocate(size_t size, size_t alignment) = 0;
+
+    /**
+     * Release memory returned by allocate() with the same size.
+     */
+    virtual void deallocate(void *ptr, size_t size) = 0;
+};
+
+}
+
+#endif
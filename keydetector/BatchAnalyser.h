@@ -0,0 +1,112 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_BATCH_ANALYSER_H
+#define KEY_DETECTOR_BATCH_ANALYSER_H
+
+#include "KeyDetector.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace KD {
+
+/**
+ * Analyse many tracks concurrently, one track per worker thread at a
+ * time, using KeyDetector::analyseBuffer() on each. Each worker has
+ * its own KeyDetector, which is reset rather than rebuilt between
+ * tracks and kept for subsequent calls to analyse().
+ *
+ * Tracks are shared out between per-worker queues up front. A worker
+ * that runs out of tracks of its own takes them from the far end of
+ * another worker's queue, so a few long tracks do not leave the other
+ * threads idle.
+ */
+class BatchAnalyser
+{
+public:
+    /**
+     * A track to analyse. Either buffer and length describe
+     * already-decoded mono input at the configured sample rate, or
+     * buffer is 0 and path names a file to be read with the loader
+     * supplied through setLoader().
+     */
+    struct Track {
+        std::string id;
+        const float *buffer;
+        size_t length;
+        std::string path;
+
+        Track() : buffer(0), length(0) { }
+    };
+
+    /**
+     * Result reported for each track. If ok is false, the track could
+     * not be loaded and analysis is empty.
+     */
+    struct Result {
+        size_t index;
+        bool ok;
+        KeyDetector::Analysis analysis;
+
+        Result() : index(0), ok(false) { }
+    };
+
+    /**
+     * Decode the file at the given path into mono samples at the
+     * configured sample rate, returning false on failure. Called
+     * from worker threads, possibly concurrently.
+     */
+    typedef std::function<bool (const std::string &path,
+                                std::vector<float> &samples)> Loader;
+
+    /**
+     * Receive the result for one track. Calls are made from worker
+     * threads as tracks complete, in no particular order, but never
+     * more than one at a time.
+     */
+    typedef std::function<void (const Track &track,
+                                const Result &result)> Callback;
+
+    /**
+     * Construct an analyser whose detectors all use the given
+     * configuration. If threads is zero, one thread is used for each
+     * available hardware thread.
+     */
+    BatchAnalyser(KeyDetector::Config config, int threads = 0);
+
+    void setLoader(Loader loader);
+
+    int getThreadCount() const;
+
+    /**
+     * Analyse all of the given tracks, returning when every track has
+     * been reported through the callback.
+     *
+     * If the loader or callback throws, the workers stop taking new
+     * tracks, and the exception is rethrown on the calling thread
+     * once every worker has finished.
+     */
+    void analyse(const std::vector<Track> &tracks, Callback callback);
+
+private:
+    KeyDetector::Config m_config;
+    int m_threads;
+    Loader m_loader;
+    std::vector<std::unique_ptr<KeyDetector> > m_detectors;
+
+    BatchAnalyser(const BatchAnalyser &); // not provided
+    BatchAnalyser &operator=(const BatchAnalyser &); // not provided
+};
+
+}
+
+#endif
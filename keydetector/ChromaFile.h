@@ -0,0 +1,245 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_CHROMA_FILE_H
+#define KEY_DETECTOR_CHROMA_FILE_H
+
+#include "KeyDetector.h"
+
+#include <cstdio>
+#include <string>
+
+namespace KD {
+
+class ChromaFrontEnd;
+class ChromaFrames;
+class MappedFile;
+
+/**
+ * A chromagram saved to disk, so that key estimation can be run again
+ * with another method or smoothing window without decoding,
+ * decimating and transforming the audio again. Write one with
+ * ChromaFileWriter and analyse it with KeyDetector::analyseChroma().
+ *
+ * The file consists of a 64-byte header followed by one record per
+ * hop. Chroma is stored without normalisation, so that one file
+ * serves both methods; a METHOD_QM detector normalises each vector as
+ * it reads it, as its own front end would have done.
+ *
+ * With FORMAT_FLOAT32 a record is 36 floats. With FORMAT_FLOAT16 it
+ * is a float holding the largest value in the vector followed by 36
+ * half-precision values scaled to a maximum of 1, 76 bytes in all,
+ * so that quiet passages lose no more precision than loud ones.
+ *
+ * Values are in the byte order of the machine that wrote the file,
+ * and open() rejects a file of the other byte order.
+ *
+ * For collections of many tracks, see ChromaStore.
+ */
+class ChromaFile
+{
+public:
+    enum Format {
+        FORMAT_FLOAT32,
+        FORMAT_FLOAT16
+    };
+
+    /**
+     * The number of chroma bins in each record, the resolution used
+     * by both methods.
+     */
+    enum { BinsPerOctave = 36 };
+
+    ChromaFile();
+
+    /**
+     * Close the file if open.
+     */
+    ~ChromaFile();
+
+    /**
+     * Open the given chroma file, closing any already open. The file
+     * is mapped into memory rather than read, so opening even a very
+     * large one is cheap and its pages are loaded only as frames are
+     * read. Return false if it cannot be opened or is not a complete
+     * chroma file.
+     */
+    bool open(std::string path);
+
+    void close();
+
+    bool isOpen() const;
+
+    Format getFormat() const { return m_format; }
+
+    /**
+     * The sample rate and tuning frequency of the analysis that
+     * produced the chromagram. A KeyDetector analysing the file must
+     * be configured with the same values.
+     */
+    double getSampleRate() const { return m_sampleRate; }
+    double getTuningFrequency() const { return m_tuningFrequency; }
+
+    /**
+     * The block and hop sizes, in input samples, of the analysis that
+     * produced the chromagram.
+     */
+    int getBlockSize() const { return m_blockSize; }
+    int getHopSize() const { return m_hopSize; }
+
+    /**
+     * Return the number of records, one per hop.
+     */
+    size_t getFrameCount() const { return m_frameCount; }
+
+    /**
+     * Write the unnormalised chroma of the given record into an array
+     * of BinsPerOctave values.
+     */
+    void readFrame(size_t index, double *chroma) const;
+
+    /**
+     * Return a view of all of the records, valid while the file
+     * remains open.
+     */
+    ChromaFrames getFrames() const;
+
+private:
+    MappedFile *m_file;
+
+    Format m_format;
+    double m_sampleRate;
+    double m_tuningFrequency;
+    int m_blockSize;
+    int m_hopSize;
+    size_t m_frameCount;
+
+    ChromaFile(const ChromaFile &); // not provided
+    ChromaFile &operator=(const ChromaFile &); // not provided
+};
+
+/**
+ * A view of consecutive chroma records in memory, such as all of a
+ * ChromaFile or one track of a ChromaStore. The view refers to the
+ * records where they lie, without copying them, and is valid only as
+ * long as the file or store it came from remains open. Copying a view
+ * is cheap.
+ */
+class ChromaFrames
+{
+public:
+    ChromaFrames() :
+        m_records(0), m_count(0), m_format(ChromaFile::FORMAT_FLOAT32) { }
+
+    ChromaFrames(const unsigned char *records, size_t count,
+                 ChromaFile::Format format) :
+        m_records(records), m_count(count), m_format(format) { }
+
+    size_t getFrameCount() const { return m_count; }
+
+    ChromaFile::Format getFormat() const { return m_format; }
+
+    /**
+     * Write the unnormalised chroma of the given frame into an array
+     * of ChromaFile::BinsPerOctave values.
+     */
+    void readFrame(size_t index, double *chroma) const;
+
+    /**
+     * For FORMAT_FLOAT32, return the stored values themselves,
+     * ChromaFile::BinsPerOctave per frame and frame after frame;
+     * otherwise return 0.
+     */
+    const float *getFloatData() const;
+
+private:
+    const unsigned char *m_records;
+    size_t m_count;
+    ChromaFile::Format m_format;
+};
+
+/**
+ * Calculate the chromagram of mono audio and write it to a
+ * ChromaFile. Only the sample rate and tuning frequency of the
+ * configuration are used; the file may be analysed with any method,
+ * smoothing window and precision.
+ */
+class ChromaFileWriter
+{
+public:
+    /**
+     * Create, or truncate, the file at the given path. Check isOK()
+     * afterwards to see whether this succeeded.
+     */
+    ChromaFileWriter(std::string path, KeyDetector::Config config,
+                     ChromaFile::Format format = ChromaFile::FORMAT_FLOAT32);
+
+    /**
+     * Close the file if close() has not already been called.
+     */
+    ~ChromaFileWriter();
+
+    /**
+     * Return false if the file could not be created or a write to it
+     * has failed.
+     */
+    bool isOK() const { return !m_failed; }
+
+    int getBlockSize() const;
+    int getHopSize() const;
+
+    /**
+     * Process a single time-domain input frame of getBlockSize()
+     * samples, as for KeyDetector::process(), and append its chroma
+     * to the file.
+     */
+    void process(const double *frame);
+    void process(const float *frame);
+
+    /**
+     * Process a complete mono buffer, framing it as
+     * KeyDetector::analyseBuffer() does, so that the file has one
+     * record for each hop that analyseBuffer() would report.
+     */
+    void processBuffer(const double *buffer, size_t length);
+    void processBuffer(const float *buffer, size_t length);
+
+    /**
+     * Return the number of records written so far.
+     */
+    size_t getFrameCount() const { return m_frameCount; }
+
+    /**
+     * Complete the header and close the file. Return false if any
+     * write failed, in which case the file should not be used.
+     */
+    bool close();
+
+private:
+    ChromaFrontEnd *m_frontEnd;
+    std::FILE *m_file;
+    ChromaFile::Format m_format;
+    double m_sampleRate;
+    double m_tuningFrequency;
+    size_t m_frameCount;
+    bool m_failed;
+
+    void writeHeader();
+    void writeChroma(const double *chroma);
+
+    template <typename T>
+    void processFrames(const T *buffer, size_t length);
+
+    ChromaFileWriter(const ChromaFileWriter &); // not provided
+    ChromaFileWriter &operator=(const ChromaFileWriter &); // not provided
+};
+
+}
+
+#endif
@@ -0,0 +1,264 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_CHROMA_STORE_H
+#define KEY_DETECTOR_CHROMA_STORE_H
+
+#include "ChromaFile.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace KD {
+
+class ChromaFrontEnd;
+class MappedFile;
+
+/**
+ * The chromagrams of many tracks in a single file, each found by a
+ * string id, for re-analysing a whole catalogue without decoding any
+ * audio. Write a store with ChromaStoreWriter.
+ *
+ * The file begins with a 64-byte header, which records the format,
+ * sample rate and tuning frequency common to every track together
+ * with the location of the track index. Each track's chroma follows
+ * as a contiguous run of records in the format of a ChromaFile. The
+ * index is stored column by column: the data offset of every track,
+ * then every frame count, then every id's offset into a table of ids,
+ * then the track numbers in order of id for lookup, then the ids.
+ *
+ * The file is only ever appended to. Adding tracks writes their
+ * chroma and then a new index after everything already in the file,
+ * and finally rewrites the header to point to the new index, so a
+ * store whose writer is interrupted still reads as it was before. The
+ * index each commit supersedes is left in place as dead space.
+ * Since every index covers all the tracks in the store, committing
+ * after each of n tracks leaves dead space growing with the square
+ * of n; see ChromaStoreWriter::commit().
+ *
+ * The file is mapped into memory. Opening a store reads nothing but
+ * the header and index, and the frames of each track are used where
+ * they lie. A reader sees the store as it was when opened.
+ */
+class ChromaStore
+{
+public:
+    ChromaStore();
+
+    /**
+     * Close the store if open.
+     */
+    ~ChromaStore();
+
+    /**
+     * Open the given store, closing any already open. Return false if
+     * it cannot be opened or is not a valid store.
+     */
+    bool open(std::string path);
+
+    void close();
+
+    bool isOpen() const;
+
+    ChromaFile::Format getFormat() const { return m_format; }
+    double getSampleRate() const { return m_sampleRate; }
+    double getTuningFrequency() const { return m_tuningFrequency; }
+    int getBlockSize() const { return m_blockSize; }
+    int getHopSize() const { return m_hopSize; }
+
+    /**
+     * Return the number of tracks. Tracks are numbered from 0 in the
+     * order in which they were added.
+     */
+    size_t getTrackCount() const { return m_trackCount; }
+
+    std::string getTrackId(size_t track) const;
+
+    /**
+     * Find the track with the given id, returning false if there is
+     * none. This is a binary search of the index.
+     */
+    bool findTrack(std::string id, size_t &track) const;
+
+    /**
+     * Return a view of the chroma frames of the given track, valid
+     * while the store remains open.
+     */
+    ChromaFrames getFrames(size_t track) const;
+
+    /**
+     * Function called by scan() for each track. The thread argument,
+     * from 0 to one less than the number of threads, identifies the
+     * calling thread, so that the function can keep state such as a
+     * KeyDetector for each thread.
+     */
+    typedef std::function<void (size_t track, const ChromaFrames &frames,
+                                int thread)> ScanFunction;
+
+    /**
+     * Call the function once for every track, using up to the given
+     * number of threads (or one per hardware thread, if threads is
+     * zero), returning when all tracks are done. Calls are made
+     * concurrently from all threads, each of which takes runs of
+     * consecutive tracks in turn, so the store is read roughly in
+     * file order.
+     *
+     * If the function throws, no further runs of tracks are started,
+     * and the exception is rethrown on the calling thread once every
+     * thread has finished.
+     */
+    void scan(ScanFunction function, int threads = 0) const;
+
+    /**
+     * Receive the result for one track from analyse(). Calls are made
+     * in no particular order, but never more than one at a time.
+     */
+    typedef std::function<void (size_t track,
+                                const KeyDetector::Analysis &analysis)>
+    AnalysisCallback;
+
+    /**
+     * Analyse every track with KeyDetector::analyseChroma(), using
+     * one detector of the given configuration per thread, reset
+     * between tracks, as for scan(). The configuration's chromaInput
+     * is set automatically.
+     *
+     * Throw std::logic_error if the store is not open or its sample
+     * rate or tuning frequency differ from the configuration. An
+     * exception thrown by the callback is rethrown as for scan().
+     */
+    void analyse(KeyDetector::Config config, AnalysisCallback callback,
+                 int threads = 0) const;
+
+private:
+    MappedFile *m_file;
+
+    ChromaFile::Format m_format;
+    double m_sampleRate;
+    double m_tuningFrequency;
+    int m_blockSize;
+    int m_hopSize;
+
+    // The index columns, in the mapped file
+    size_t m_trackCount;
+    const uint64_t *m_dataOffsets;
+    const uint64_t *m_frameCounts;
+    const uint64_t *m_idOffsets;
+    const uint64_t *m_byId;
+    const char *m_ids;
+
+    ChromaStore(const ChromaStore &); // not provided
+    ChromaStore &operator=(const ChromaStore &); // not provided
+};
+
+/**
+ * Add tracks to a ChromaStore, creating it if necessary. Only the
+ * sample rate and tuning frequency of the configuration are used.
+ * There should be no more than one writer for a store at a time,
+ * though any number of ChromaStores may read it meanwhile.
+ */
+class ChromaStoreWriter
+{
+public:
+    /**
+     * Open the store at the given path for adding tracks, creating it
+     * if it does not exist. An existing store must have the same
+     * sample rate, tuning frequency and format. Check isOK()
+     * afterwards to see whether this succeeded.
+     */
+    ChromaStoreWriter(std::string path, KeyDetector::Config config,
+                      ChromaFile::Format format = ChromaFile::FORMAT_FLOAT32);
+
+    /**
+     * Commit any tracks added since the last commit() and close the
+     * file.
+     */
+    ~ChromaStoreWriter();
+
+    /**
+     * Return false if the store could not be opened or created, or if
+     * a write to it has failed.
+     */
+    bool isOK() const { return !m_failed; }
+
+    /**
+     * Calculate the chromagram of a complete mono buffer, framing it
+     * as KeyDetector::analyseBuffer() does, and add it as a track
+     * with the given id. Return false, adding nothing, if the id is
+     * already in the store or the write fails.
+     */
+    bool addTrack(std::string id, const double *buffer, size_t length);
+    bool addTrack(std::string id, const float *buffer, size_t length);
+
+    /**
+     * Add already calculated chroma as a track with the given id, for
+     * example to gather ChromaFiles into a store. The frames are
+     * converted to the store's format if necessary. Return false as
+     * for addTrack() above.
+     */
+    bool addTrack(std::string id, const ChromaFrames &frames);
+
+    /**
+     * Return the number of tracks, including those not yet committed.
+     */
+    size_t getTrackCount() const { return m_dataOffsets.size(); }
+
+    /**
+     * Write a new index covering every track added so far and update
+     * the header to refer to it, making the tracks visible to stores
+     * opened afterwards. Return false if any write has failed.
+     *
+     * The whole index is written again each time, about 32 bytes plus
+     * the length of its id for every track in the store, and the
+     * previous index is left behind as dead space. Commit in batches
+     * of many tracks, not after each one: committing after every
+     * track of a 100,000-track store would leave well over 100 GB of
+     * dead indexes.
+     */
+    bool commit();
+
+private:
+    ChromaFrontEnd *m_frontEnd;
+    std::FILE *m_file;
+    ChromaFile::Format m_format;
+    double m_sampleRate;
+    double m_tuningFrequency;
+    bool m_failed;
+
+    // Position at which the next track or index is written
+    uint64_t m_end;
+
+    // Index of every track, in order of addition
+    std::vector<uint64_t> m_dataOffsets;
+    std::vector<uint64_t> m_frameCounts;
+    std::vector<const std::string *> m_idsByTrack;
+    std::map<std::string, size_t> m_tracksById;
+    size_t m_committed;
+
+    bool load();
+    bool seek(uint64_t offset);
+    bool write(const void *data, size_t size);
+    bool writeIndex();
+    bool beginTrack(std::string id);
+    void endTrack(std::string id, size_t frames);
+
+    template <typename T>
+    bool addFrames(std::string id, const T *buffer, size_t length);
+
+    ChromaStoreWriter(const ChromaStoreWriter &); // not provided
+    ChromaStoreWriter &operator=(const ChromaStoreWriter &); // not provided
+};
+
+}
+
+#endif
@@ -10,11 +10,19 @@
 #ifndef KEY_DETECTOR_H
 #define KEY_DETECTOR_H
 
+#include "Allocator.h"
+
 #include <vector>
+#include <deque>
+#include <cstddef>
 
 namespace KD {
 
 class KeyDetectorIface;
+class ChromaFrontEnd;
+class ChromaFile;
+class ChromaFrames;
+class FrameRing;
 
 class KeyDetector
 {
@@ -23,6 +31,37 @@ public:
         METHOD_QM,
         METHOD_DASCHUER
     };
+
+    /**
+     * Precision in which a detector keeps its history of chroma
+     * vectors. Lower precisions reduce the memory needed per detector
+     * at a small cost in accuracy; see getWorkingMemorySize().
+     */
+    enum Precision {
+        PRECISION_DOUBLE,
+        PRECISION_FLOAT,
+        PRECISION_FIXED16
+    };
+
+    /**
+     * How the channels of multichannel input are treated: mixed down
+     * by averaging all of them, or the first two (the front left and
+     * right of most layouts), or by taking one alone; or analysed
+     * separately, with a key for each channel.
+     */
+    enum ChannelMode {
+        CHANNELS_MEAN,
+        CHANNELS_MID,
+        CHANNELS_SELECT,
+        CHANNELS_SEPARATE
+    };
+
+    enum InstructionSet {
+        INSTRUCTIONS_AUTO,
+        INSTRUCTIONS_SCALAR,
+        INSTRUCTIONS_SSE2,
+        INSTRUCTIONS_AVX2
+    };
         
     struct Config {
         Method method;
@@ -30,18 +69,135 @@ public:
         double tuningFrequency;
         int smoothingWindowLength;
 
+        /**
+         * Storage precision for the chroma history. This affects
+         * METHOD_QM only, as METHOD_DASCHUER keeps no history beyond
+         * the current chroma vector.
+         */
+        Precision precision;
+
+        /**
+         * Source of memory for the detector's working buffers, or 0
+         * to use the system heap. See Allocator.
+         */
+        Allocator *allocator;
+
+        /**
+         * Criteria for hasConverged(): the key reported by process()
+         * or push() must have stayed the same, with a confidence of
+         * at least convergenceConfidence on every hop, for
+         * convergenceTime seconds of input.
+         */
+        double convergenceConfidence;
+        double convergenceTime;
+
+        /**
+         * Number of channels in the input given to
+         * processInterleaved() and processPlanar(), how to treat
+         * them, and the channel taken for CHANNELS_SELECT. With more
+         * than one channel, the front end needs an extra block of
+         * double-precision samples to mix into.
+         *
+         * For CHANNELS_SEPARATE, each channel has its own decimators
+         * and key estimation state but all share one chromagram, and
+         * only processInterleaved() and processPlanar() may be used.
+         */
+        int channels;
+        ChannelMode channelMode;
+        int selectedChannel;
+
+        /**
+         * If true, the detector will only be given chroma, through
+         * processChroma(), accumulateChroma() or analyseChroma(), and
+         * creates no decimators or chromagram, so it is much cheaper
+         * to construct. No function taking audio may then be called.
+         */
+        bool chromaInput;
+
         Config(Method _method, double _sampleRate) :
             method(_method),
             sampleRate(_sampleRate),
             tuningFrequency(440.0),
-            smoothingWindowLength(10) {
+            smoothingWindowLength(10),
+            precision(PRECISION_DOUBLE),
+            allocator(0),
+            convergenceConfidence(0.05),
+            convergenceTime(30.0),
+            channels(1),
+            channelMode(CHANNELS_MEAN),
+            selectedChannel(0),
+            chromaInput(false) {
         }
     };
     
+    /**
+     * The result of analyseBuffer(): one key index per hop (in the
+     * range 0-24, as returned by process()), 24 key strengths per hop
+     * laid out consecutively as for getKeyStrengths(), and a single
+     * key index summarising the whole buffer.
+     */
+    struct Analysis {
+        std::vector<int> keys;
+        std::vector<double> keyStrengths;
+        int globalKey;
+
+        Analysis() : globalKey(0) { }
+    };
+
+    /**
+     * A change of key reported by push(). The frame is the index,
+     * counted from the first sample pushed, of the first sample of
+     * the block at which the new key was first detected.
+     */
+    struct KeyChange {
+        size_t frame;
+        int key;
+
+        KeyChange(size_t _frame, int _key) : frame(_frame), key(_key) { }
+    };
+
+    /**
+     * The result of finish(): a key index in the range 0-24, as
+     * returned by process(), and a confidence between 0 and 1.
+     */
+    struct GlobalKey {
+        int key;
+        double confidence;
+
+        GlobalKey() : key(0), confidence(0.0) { }
+    };
+
     KeyDetector(Config config);
 
     virtual ~KeyDetector();
 
+    /**
+     * Return the detector to its freshly constructed state, clearing
+     * all chroma, smoothing and median history and any streaming
+     * input, without allocating or freeing memory.
+     */
+    void reset();
+
+    /**
+     * Change the detector's configuration and reset it. Memory is
+     * reallocated only where sizes actually change: if only the
+     * smoothing window length differs, only the buffers that depend
+     * on it are resized, and if nothing differs this is the same as
+     * reset(). A change of method, sample rate, tuning frequency,
+     * precision, allocator, channel layout or chromaInput requires a
+     * new backend, though it will reuse the kernels of any destroyed
+     * detector of the same configuration (see releaseCachedKernels()).
+     *
+     * If memory cannot be allocated, the exception is passed on and
+     * the detector keeps its old configuration. For a single-channel
+     * detector it is then exactly as it was, history included; with
+     * CHANNELS_SEPARATE, a change of smoothing window alone may have
+     * reset some channels.
+     */
+    void reconfigure(Config config);
+
+    Config getConfig() const { return m_config; }
+
     /**
      * Process a single time-domain input sample frame of length
      * getBlockSize(). Successive calls should provide overlapped data
@@ -50,7 +206,200 @@ public:
      * Return a key index in the range 0-24, where 0 indicates no key
      * detected, 1 is C major, and 13 is C minor.
      */
-    int process(double *frame);
+    int process(const double *frame);
+
+    /**
+     * Process a single-precision input frame, as for
+     * process(const double *). The frame is decimated in single
+     * precision without first being converted to double.
+     */
+    int process(const float *frame);
+
+    /**
+     * Process a frame of getBlockSize() samples in each of
+     * config.channels channels, interleaved, treating the channels as
+     * config.channelMode specifies. The channels are mixed into a
+     * single block in one pass over the input, and that block
+     * decimated and analysed as for process().
+     *
+     * For CHANNELS_SEPARATE, return the key for the first channel;
+     * the others are available from getChannelKey().
+     */
+    int processInterleaved(const double *frame);
+    int processInterleaved(const float *frame);
+
+    /**
+     * Process a multichannel frame as for processInterleaved(), with
+     * each channel in a separate array of getBlockSize() samples.
+     */
+    int processPlanar(const double *const *frames);
+    int processPlanar(const float *const *frames);
+
+    /**
+     * Return the key found for the given channel by the last call to
+     * processInterleaved() or processPlanar() with
+     * CHANNELS_SEPARATE. Other methods of this class that report on a
+     * single key, such as getKeyStrengths(), refer to the first
+     * channel.
+     */
+    int getChannelKey(int channel) const;
+
+    /**
+     * Write the key strengths of the given channel, as for
+     * getKeyStrengths(double *), with CHANNELS_SEPARATE.
+     */
+    void getChannelKeyStrengths(int channel, double *strengths) const;
+
+    /**
+     * Process a single chroma vector in place of a frame of audio, as
+     * for process(). The vector has ChromaFile::BinsPerOctave values,
+     * unnormalised, as returned by ChromaFile::readFrame(); it is
+     * normalised as the detector's own front end would do.
+     */
+    int processChroma(const double *chroma);
+
+    /**
+     * Accumulate a single unnormalised chroma vector for
+     * global-key-only analysis, as for accumulate().
+     */
+    void accumulateChroma(const double *chroma);
+
+    /**
+     * Analyse every frame of a chromagram saved with
+     * ChromaFileWriter, with the same result as analyseBuffer() would
+     * give for the audio it was calculated from, except for the
+     * rounding of the stored values. This needs none of the
+     * decimation or constant-Q processing, so is far cheaper, and the
+     * detector may be configured with chromaInput set.
+     *
+     * Throw std::logic_error if the file is not open or its sample
+     * rate or tuning frequency differ from the configuration.
+     */
+    Analysis analyseChroma(const ChromaFile &file);
+
+    /**
+     * Analyse a sequence of saved chroma frames, such as one track of
+     * a ChromaStore, as for analyseChroma(const ChromaFile &). The
+     * frames must have been calculated at the configured sample rate
+     * and tuning frequency, which is not checked.
+     */
+    Analysis analyseChroma(const ChromaFrames &frames);
+
+    /**
+     * Analyse a complete mono time-domain buffer of the given length,
+     * such as a whole decoded track. The buffer is divided into
+     * blocks internally, exactly as a caller of process() would do,
+     * starting at sample 0 and zero-padding the final block.
+     *
+     * The global key is the key reported for the largest number of
+     * hops, ignoring hops for which no key was detected.
+     *
+     * Analysis continues from whatever state earlier calls left the
+     * detector in, so a fresh detector should be used for each track.
+     */
+    Analysis analyseBuffer(const double *buffer, size_t length);
+
+    /**
+     * Analyse a complete single-precision buffer, as for
+     * analyseBuffer(const double *, size_t).
+     */
+    Analysis analyseBuffer(const float *buffer, size_t length);
+
+    /**
+     * Analyse a complete buffer as for analyseBuffer(), using up to
+     * the given number of threads (or one per hardware thread, if
+     * threads is zero). The chromagram is calculated for consecutive
+     * segments of the buffer concurrently; the key estimation that
+     * follows, which depends on all preceding hops, runs afterwards
+     * on the calling thread. The result matches that of
+     * analyseBuffer() except for negligible differences in decimator
+     * filter state at the start of each segment.
+     *
+     * Buffers too short to be worth dividing are analysed serially.
+     */
+    Analysis analyseBufferParallel(const double *buffer, size_t length,
+                                   int threads = 0);
+
+    Analysis analyseBufferParallel(const float *buffer, size_t length,
+                                   int threads = 0);
+
+    /**
+     * Global-key-only analysis, for when one key per track is all
+     * that is wanted. Process a single frame as for process(), but
+     * only accumulate the statistics needed for one estimate over
+     * the whole input, skipping the per-hop key decision, median
+     * filtering and key strengths. For METHOD_QM the statistic is
+     * the sum of all chroma vectors; for METHOD_DASCHUER it is the
+     * detector's smoothed scale and progression probabilities.
+     *
+     * Call finish() to obtain the estimate. Accumulation is
+     * independent of process() for METHOD_QM but shares state with
+     * it for METHOD_DASCHUER, so the two should not be mixed on one
+     * detector between resets.
+     */
+    void accumulate(const double *frame);
+    void accumulate(const float *frame);
+
+    /**
+     * Accumulate a complete mono buffer for global-key-only analysis,
+     * framing it as analyseBuffer() does.
+     */
+    void accumulateBuffer(const double *buffer, size_t length);
+    void accumulateBuffer(const float *buffer, size_t length);
+
+    /**
+     * Return the key estimated from everything accumulated since
+     * construction or the last reset(), with a confidence between 0
+     * (a tie with the next most likely key) and 1. Accumulation may
+     * continue afterwards.
+     */
+    GlobalKey finish();
+
+    /**
+     * Return true if the key reported by process() or push() has
+     * converged according to the convergenceConfidence and
+     * convergenceTime of the configuration, in which case a caller
+     * interested only in the overall key of a recording may stop
+     * decoding and analysing it. The key itself is the one most
+     * recently returned. Offline analysis with analyseBuffer() or
+     * accumulate() does not affect this.
+     */
+    bool hasConverged() const;
+
+    /**
+     * Return a value between 0 and 1 indicating how clearly the key
+     * returned by the last process() call (or the last block of the
+     * last push()) led every other key: for METHOD_QM, the relative
+     * difference between the profile correlations of that key and
+     * the best other key, and for METHOD_DASCHUER, between their
+     * progression probabilities. This is 0 if no key was detected,
+     * or if the median filtering is still reporting a key other than
+     * the one currently leading.
+     */
+    double getConfidence() const;
+
+    /**
+     * Supply a chunk of mono time-domain input of any length. Input
+     * is accumulated internally and process() is called each time a
+     * complete block becomes available, with an advance of
+     * getHopSize() between blocks, so the caller need not do any
+     * framing of its own.
+     *
+     * Whenever the detected key differs from the previous one (and
+     * for the first block), a KeyChange is queued for retrieval with
+     * getKeyChange(). Return the number of key changes queued during
+     * this call.
+     *
+     * Streaming input should not be mixed with calls to process() or
+     * analyseBuffer() on the same detector.
+     */
+    int push(const float *samples, size_t count);
+
+    /**
+     * Retrieve the oldest key change queued by push(), removing it
+     * from the queue. Return false if there are none.
+     */
+    bool getKeyChange(KeyChange &change);
 
     /**
      * Return a 24-element vector containing the correlation of the
@@ -60,11 +409,116 @@ public:
      */
     std::vector<double> getKeyStrengths() const;
 
+    /**
+     * Write the same 24 key strengths as getKeyStrengths() into the
+     * caller's array, which must have room for at least 24 values.
+     * This does not allocate any memory.
+     */
+    void getKeyStrengths(double *strengths) const;
+
     int getHopSize() const;
     int getBlockSize() const;
 
+    /**
+     * Calculate the values getBlockSize() and getHopSize() would
+     * return for a detector with the given configuration, without
+     * constructing one. This does not allocate any memory.
+     */
+    static void getBlockAndHopSize(Config config,
+                                   int &blockSize, int &hopSize);
+
+    /**
+     * Return the number of bytes of working memory this detector has
+     * allocated, including any streaming input buffer.
+     *
+     * This does not include the constant-Q kernel and decimation
+     * filters. They are not shared: every detector holds its own for
+     * as long as it exists, and two detectors in use at once hold two
+     * copies. They are only reused once a detector has been destroyed
+     * (see releaseCachedKernels()). Nor does it include the key
+     * profile tables, of which there is one copy for all detectors.
+     *
+     * For the default configuration at 44.1 kHz, a METHOD_QM detector
+     * needs about 53 KB, of which the chroma history accounts for 4
+     * KB in double precision, 2 KB in float and 1 KB in 16-bit fixed
+     * point; the remainder is mostly the decimated input frame. A
+     * METHOD_DASCHUER detector needs about 50 KB. Streaming with
+     * push() adds a ring of floats holding block plus hop samples,
+     * each stored twice so that every block is contiguous: 8 bytes
+     * per sample of block plus hop, about 290 KB.
+     */
+    size_t getWorkingMemorySize() const;
+
+    /**
+     * Each detector has its own constant-Q kernel and decimation
+     * filters, since the qm-dsp objects that hold them also hold
+     * working buffers and cannot be used by two detectors at once.
+     * When a detector is destroyed they are kept in a process-wide
+     * cache and handed to the next detector created with the same
+     * sample rate and tuning frequency, which then need not build
+     * them again. Call this to free any kept in this way. It is safe
+     * to call at any time from any thread.
+     */
+    static void releaseCachedKernels();
+
+    /**
+     * The library's per-hop numerical kernels have scalar, SSE2 and
+     * AVX2 implementations, and the best one the CPU supports is
+     * chosen when the library is loaded. Force a particular one, for
+     * example when testing or benchmarking, or return to the
+     * automatic choice with INSTRUCTIONS_AUTO. The environment
+     * variable KEYDETECTOR_INSTRUCTIONS ("scalar", "sse2" or "avx2")
+     * does the same at load time.
+     *
+     * Return false, changing nothing, if the instruction set is not
+     * supported by this CPU or was not compiled in. Results are
+     * identical whichever set is in use. The setting applies to every
+     * detector in the process and may be changed from any thread.
+     */
+    static bool setInstructionSet(InstructionSet set);
+
+    /**
+     * Return the instruction set currently in use, which is never
+     * INSTRUCTIONS_AUTO.
+     */
+    static InstructionSet getInstructionSet();
+
 private:
+    Config m_config;
     KeyDetectorIface *m_kdi;
+
+    // Streaming state, created on first push()
+    FrameRing *m_ring;
+    size_t m_streamFrame;
+    int m_streamKey;
+    std::deque<KeyChange> m_keyChanges;
+
+    // Convergence state, updated by process() and push()
+    int m_stableKey;
+    int m_stableHops;
+    double m_confidence;
+
+    // Multichannel state. For CHANNELS_SEPARATE, m_kdi handles the
+    // first channel and m_channelKdis the rest, all fed from the
+    // chroma of one front end
+    ChromaFrontEnd *m_channelFrontEnd;
+    std::vector<KeyDetectorIface *> m_channelKdis;
+    std::vector<int> m_channelKeys;
+    std::vector<const double *> m_doubleChannels;
+    std::vector<const float *> m_floatChannels;
+
+    int updateConvergence(int key);
+
+    void createChannels();
+    void deleteChannels();
+
+    template <typename T>
+    int processChannels(const T *const *channels, int stride);
+
+    void summarise(Analysis &analysis) const;
+
+    KeyDetector(const KeyDetector &); // not provided
+    KeyDetector &operator=(const KeyDetector &); // not provided
 };
 
 }
@@ -0,0 +1,121 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_MULTI_STREAM_KEY_DETECTOR_H
+#define KEY_DETECTOR_MULTI_STREAM_KEY_DETECTOR_H
+
+#include "KeyDetector.h"
+
+#include <vector>
+
+namespace KD {
+
+class Arena;
+class ChromaFrontEnd;
+class SlidingMedian;
+
+/**
+ * Detect keys in many independent mono streams with the same
+ * configuration, advancing all of them by one hop per call. Each
+ * stream gets the same keys as a METHOD_QM KeyDetector of that
+ * configuration would give it on its own.
+ *
+ * All streams share one chromagram, and so one constant-Q kernel,
+ * which stays in cache while it is applied to each stream in turn;
+ * only the decimator filters are per stream. The key estimation
+ * state of all streams is held together, field by field, so that
+ * the correlation against the key profiles is a single product of
+ * the streams' mean chroma with the profile matrix, and the
+ * averaging around it runs over contiguous arrays.
+ *
+ * Only METHOD_QM is supported, and the chroma history is always
+ * kept in double precision. A detector is not thread-safe.
+ */
+class MultiStreamKeyDetector
+{
+public:
+    /**
+     * Construct a detector for the given number of streams. Throw
+     * std::logic_error if config.method is not METHOD_QM.
+     */
+    MultiStreamKeyDetector(KeyDetector::Config config, int streams);
+
+    ~MultiStreamKeyDetector();
+
+    int getStreamCount() const { return m_streams; }
+
+    int getBlockSize() const;
+    int getHopSize() const;
+
+    /**
+     * Process one frame of getBlockSize() samples for every stream,
+     * frames[s] being the frame for stream s, and write each
+     * stream's key (in the range 0-24, as for KeyDetector::process())
+     * to keys[s]. Successive calls should advance every stream by
+     * getHopSize() samples.
+     */
+    void process(const double *const *frames, int *keys);
+    void process(const float *const *frames, int *keys);
+
+    /**
+     * Write the 24 key strengths for the given stream from the last
+     * call to process(), as for KeyDetector::getKeyStrengths().
+     */
+    void getKeyStrengths(int stream, double *strengths) const;
+
+    /**
+     * Return every stream to its freshly constructed state.
+     */
+    void reset();
+
+    /**
+     * Clear the history of one stream, for example when the source
+     * feeding it changes, leaving the others untouched. Results for
+     * that stream may differ from those of a fresh detector in the
+     * least significant bits, as the periodic re-summing of chroma
+     * history is done for all streams at once.
+     */
+    void resetStream(int stream);
+
+    /**
+     * Return the number of bytes of working memory allocated, as for
+     * KeyDetector::getWorkingMemorySize().
+     */
+    size_t getWorkingMemorySize() const;
+
+private:
+    int m_streams;
+    ChromaFrontEnd *m_frontEnd;
+
+    int m_chromaBufferSize;
+    int m_bufferIndex;
+
+    // Each array holds one row per stream, rows following one another
+    Arena *m_arena;
+    double *m_chromaBuffer; // m_chromaBufferSize chroma frames per stream
+    double *m_hpcpSum;      // running sum over each stream's history
+    double *m_meanHPCP;     // zero-mean average of each stream's history
+    double *m_correlations; // with every profile shift, per stream
+    int *m_filling;         // frames of history so far, per stream
+
+    std::vector<SlidingMedian *> m_medians;
+
+    template <typename T>
+    void processFrames(const T *const *frames, int *keys);
+
+    void addChroma(int stream, const double *chroma);
+    void resumHPCP();
+
+    MultiStreamKeyDetector(const MultiStreamKeyDetector &); // not provided
+    MultiStreamKeyDetector &operator=(const MultiStreamKeyDetector &); // not provided
+};
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_REAL_TIME_KEY_DETECTOR_H
+#define KEY_DETECTOR_REAL_TIME_KEY_DETECTOR_H
+
+#include "KeyDetector.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace KD {
+
+template <typename T> class SPSCRing;
+
+/**
+ * Run a KeyDetector on a worker thread of its own, for callers such
+ * as audio callbacks that cannot afford the detector's processing
+ * time on their own thread.
+ *
+ * One thread supplies input with push(), which copies it into a
+ * lock-free single-producer/single-consumer ring and returns at once
+ * without blocking, allocating or making system calls. The worker
+ * takes complete blocks from the ring, runs the detector on them and
+ * publishes one Result per hop through a second such ring, from
+ * which one thread (not necessarily the same one) collects them with
+ * getResult(). All memory is allocated on construction.
+ *
+ * If the worker falls behind, input that does not fit in the ring is
+ * discarded and counted as an overrun, as are results that the
+ * consumer does not collect in time; see getStatistics().
+ *
+ * Should the detector throw on the worker thread, the worker stops
+ * and getStatistics() reports it as failed. No more results are
+ * published, and input is counted as overruns once the ring fills.
+ */
+class RealTimeKeyDetector
+{
+public:
+    /**
+     * The key detected for one hop. The frame is the index, counted
+     * from the first sample pushed, of the first sample of the block.
+     * The key is in the range 0-24, as returned by
+     * KeyDetector::process(), and the confidence and key strengths
+     * are those of KeyDetector::getConfidence() and getKeyStrengths().
+     *
+     * Latency is the number of samples that had been pushed beyond
+     * the end of the block by the time the result was published.
+     */
+    struct Result {
+        size_t frame;
+        int key;
+        double confidence;
+        double keyStrengths[24];
+        size_t latency;
+
+        Result() : frame(0), key(0), confidence(0.0),
+                   keyStrengths(), latency(0) { }
+    };
+
+    /**
+     * Counters describing the detector's progress since
+     * construction. inputOverruns is the number of samples discarded
+     * because the input ring was full, and resultOverruns the number
+     * of results discarded because the result ring was. Latencies are
+     * in samples, as for Result. failed is true if the worker thread
+     * has stopped because the detector threw an exception.
+     */
+    struct Statistics {
+        size_t samplesPushed;
+        size_t hopsProcessed;
+        size_t inputOverruns;
+        size_t resultOverruns;
+        size_t lastLatency;
+        size_t maxLatency;
+        bool failed;
+
+        Statistics() : samplesPushed(0), hopsProcessed(0),
+                       inputOverruns(0), resultOverruns(0),
+                       lastLatency(0), maxLatency(0), failed(false) { }
+    };
+
+    /**
+     * Construct a detector with the given configuration and start its
+     * worker thread. The input ring holds bufferDuration seconds of
+     * audio, or one block plus one hop if that is longer, and the
+     * result ring holds as many results as the input ring does hops.
+     *
+     * Input is mono audio, so the configuration must have one channel
+     * and must not set chromaInput; throw std::logic_error otherwise.
+     */
+    RealTimeKeyDetector(KeyDetector::Config config,
+                        double bufferDuration = 2.0);
+
+    /**
+     * Stop the worker thread and free everything. Input that has not
+     * yet been processed is discarded.
+     */
+    ~RealTimeKeyDetector();
+
+    /**
+     * Supply mono input of any length. Call from one thread only.
+     * This is wait-free. Return the number of samples accepted, which
+     * is less than count only if the input ring was full.
+     */
+    size_t push(const float *samples, size_t count);
+
+    /**
+     * Retrieve the oldest result not yet collected, returning false
+     * if there are none. Call from one thread only. This is
+     * wait-free.
+     */
+    bool getResult(Result &result);
+
+    /**
+     * Return the counters so far. This may be called from any thread.
+     */
+    Statistics getStatistics() const;
+
+    int getHopSize() const { return m_hopSize; }
+    int getBlockSize() const { return m_blockSize; }
+
+private:
+    KeyDetector m_detector;
+    int m_blockSize;
+    int m_hopSize;
+    double m_sampleRate;
+
+    SPSCRing<float> *m_input;
+    SPSCRing<Result> *m_results;
+
+    // Used by the worker thread only
+    FrameRing *m_frames;
+    std::vector<float> m_scratch;
+
+    std::atomic<bool> m_running;
+    std::atomic<size_t> m_samplesPushed;
+    std::atomic<size_t> m_hopsProcessed;
+    std::atomic<size_t> m_inputOverruns;
+    std::atomic<size_t> m_resultOverruns;
+    std::atomic<size_t> m_lastLatency;
+    std::atomic<size_t> m_maxLatency;
+    std::atomic<bool> m_failed;
+
+    std::thread m_worker;
+
+    void run();
+    void processInput();
+
+    RealTimeKeyDetector(const RealTimeKeyDetector &); // not provided
+    RealTimeKeyDetector &operator=(const RealTimeKeyDetector &); // not provided
+};
+
+}
+
+#endif
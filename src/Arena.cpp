@@ -0,0 +1,91 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "Arena.h"
+
+#include "keydetector/Allocator.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace KD {
+
+Arena::Arena(Allocator *allocator) :
+    m_allocator(allocator),
+    m_base(0),
+    m_capacity(0),
+    m_reserved(0)
+{
+}
+
+Arena::~Arena()
+{
+    release();
+}
+
+size_t
+Arena::reserve(size_t bytes)
+{
+    size_t offset = m_reserved;
+    m_reserved += (bytes + alignment - 1) & ~(alignment - 1);
+    return offset;
+}
+
+void
+Arena::commit()
+{
+    if (m_reserved <= m_capacity) {
+        return;
+    }
+
+    // The old block is released only once the new one has been
+    // allocated, so that if allocation throws, the arena and the
+    // addresses obtained from it are still valid
+    char *base = 0;
+
+    if (m_allocator) {
+        base = static_cast<char *>
+            (m_allocator->allocate(m_reserved, alignment));
+    } else {
+        // Over-allocate, and keep the original pointer just before
+        // the aligned block so we can free it again
+        void *raw = malloc(m_reserved + alignment + sizeof(void *));
+        if (!raw) {
+            throw std::bad_alloc();
+        }
+        size_t addr = reinterpret_cast<size_t>(raw) + sizeof(void *);
+        addr = (addr + alignment - 1) & ~(alignment - 1);
+        base = reinterpret_cast<char *>(addr);
+        reinterpret_cast<void **>(base)[-1] = raw;
+    }
+
+    release();
+
+    m_base = base;
+    m_capacity = m_reserved;
+}
+
+void
+Arena::release()
+{
+    if (!m_base) {
+        return;
+    }
+
+    if (m_allocator) {
+        m_allocator->deallocate(m_base, m_capacity);
+    } else {
+        free(reinterpret_cast<void **>(m_base)[-1]);
+    }
+
+    m_base = 0;
+    m_capacity = 0;
+}
+
+}
@@ -0,0 +1,76 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_ARENA_H
+#define KEY_DETECTOR_ARENA_H
+
+#include <cstddef>
+
+namespace KD {
+
+class Allocator;
+
+/**
+ * A single block of memory divided up among several buffers.
+ *
+ * Buffers are laid out in two passes: first reserve() each one,
+ * noting the offset it returns, then commit() to make sure the block
+ * is large enough and get() each buffer's address from its offset.
+ * Every buffer starts on a cache line boundary. Laying out again
+ * after clear() reuses the existing block if it is big enough, but
+ * any addresses previously obtained from get() must be refreshed
+ * after commit().
+ *
+ * If commit() throws, the arena keeps its existing block and the
+ * addresses obtained from it remain valid. The block never shrinks,
+ * so laying out again with sizes that fitted before cannot throw.
+ */
+class Arena
+{
+public:
+    static const size_t alignment = 64;
+
+    /**
+     * Construct an empty arena, taking memory from the given
+     * allocator, or from the system heap if it is 0.
+     */
+    Arena(Allocator *allocator);
+    ~Arena();
+
+    void clear() { m_reserved = 0; }
+
+    size_t reserve(size_t bytes);
+
+    template <typename T>
+    size_t reserve(size_t count) { return reserve(count * sizeof(T)); }
+
+    void commit();
+
+    template <typename T>
+    T *get(size_t offset) const {
+        return reinterpret_cast<T *>(m_base + offset);
+    }
+
+    size_t getSize() const { return m_capacity; }
+
+private:
+    Allocator *m_allocator;
+    char *m_base;
+    size_t m_capacity;
+    size_t m_reserved;
+
+    void release();
+
+    Arena(const Arena &); // not provided
+    Arena &operator=(const Arena &); // not provided
+};
+
+}
+
+#endif
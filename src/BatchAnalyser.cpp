@@ -0,0 +1,189 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "keydetector/BatchAnalyser.h"
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace KD {
+
+namespace {
+
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+};
+
+struct Batch {
+    const std::vector<BatchAnalyser::Track> *tracks;
+    BatchAnalyser::Callback callback;
+    const BatchAnalyser::Loader *loader;
+    std::vector<WorkQueue> queues;
+    std::mutex callbackMutex;
+    std::atomic<bool> failed;
+    std::vector<std::exception_ptr> errors; // one per worker
+
+    Batch(int threads) :
+        tracks(0), loader(0), queues(threads),
+        failed(false), errors(threads) { }
+
+    // Take the next task from our own queue, or failing that steal
+    // the last task from someone else's. Once any worker has failed,
+    // there are no more tasks for anyone
+    bool next(int worker, size_t &task) {
+        if (failed) {
+            return false;
+        }
+        int n = int(queues.size());
+        for (int i = 0; i < n; ++i) {
+            WorkQueue &q = queues[(worker + i) % n];
+            std::lock_guard<std::mutex> guard(q.mutex);
+            if (q.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+            } else {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+void
+processTasks(Batch *batch, int worker, KeyDetector *detector)
+{
+    std::vector<float> loaded;
+    size_t task;
+
+    while (batch->next(worker, task)) {
+
+        const BatchAnalyser::Track &track = (*batch->tracks)[task];
+        BatchAnalyser::Result result;
+        result.index = task;
+
+        const float *buffer = track.buffer;
+        size_t length = track.length;
+
+        if (!buffer && *batch->loader) {
+            loaded.clear();
+            if ((*batch->loader)(track.path, loaded)) {
+                buffer = loaded.data();
+                length = loaded.size();
+            }
+        }
+
+        if (buffer) {
+            detector->reset();
+            result.analysis = detector->analyseBuffer(buffer, length);
+            result.ok = true;
+        }
+
+        std::lock_guard<std::mutex> guard(batch->callbackMutex);
+        batch->callback(track, result);
+    }
+}
+
+// Keep any exception for the calling thread to rethrow
+void
+runWorker(Batch *batch, int worker, KeyDetector *detector)
+{
+    try {
+        processTasks(batch, worker, detector);
+    } catch (...) {
+        batch->errors[worker] = std::current_exception();
+        batch->failed = true;
+    }
+}
+
+}
+
+BatchAnalyser::BatchAnalyser(KeyDetector::Config config, int threads) :
+    m_config(config),
+    m_threads(threads)
+{
+    if (m_threads <= 0) {
+        m_threads = int(std::thread::hardware_concurrency());
+    }
+    if (m_threads <= 0) {
+        m_threads = 1;
+    }
+}
+
+void
+BatchAnalyser::setLoader(Loader loader)
+{
+    m_loader = loader;
+}
+
+int
+BatchAnalyser::getThreadCount() const
+{
+    return m_threads;
+}
+
+void
+BatchAnalyser::analyse(const std::vector<Track> &tracks, Callback callback)
+{
+    int threads = m_threads;
+    if (size_t(threads) > tracks.size()) {
+        threads = int(tracks.size());
+    }
+    if (threads == 0) {
+        return;
+    }
+
+    Batch batch(threads);
+    batch.tracks = &tracks;
+    batch.callback = callback;
+    batch.loader = &m_loader;
+
+    for (size_t i = 0; i < tracks.size(); ++i) {
+        batch.queues[i % threads].tasks.push_back(i);
+    }
+
+    // Detectors are kept from one batch to the next
+    while (m_detectors.size() < size_t(threads)) {
+        m_detectors.push_back(std::unique_ptr<KeyDetector>
+                              (new KeyDetector(m_config)));
+    }
+
+    std::vector<std::thread> workers;
+    try {
+        for (int i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(runWorker, &batch, i,
+                                          m_detectors[i].get()));
+        }
+    } catch (...) {
+        batch.errors[0] = std::current_exception();
+        batch.failed = true;
+    }
+
+    // The calling thread does its share too
+    runWorker(&batch, 0, m_detectors[0].get());
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    for (int i = 0; i < threads; ++i) {
+        if (batch.errors[i]) {
+            std::rethrow_exception(batch.errors[i]);
+        }
+    }
+}
+
+}
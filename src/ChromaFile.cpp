@@ -0,0 +1,297 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "keydetector/ChromaFile.h"
+
+#include "ChromaFrontEnd.h"
+#include "ChromaRecord.h"
+#include "MappedFile.h"
+
+#include <cstring>
+#include <stdint.h>
+
+namespace KD {
+
+static const char kMagic[8] = { 'K', 'D', 'C', 'H', 'R', 'O', 'M', 'A' };
+static const uint32_t kVersion = 1;
+static const int kBins = ChromaFile::BinsPerOctave;
+
+// Laid out so as to need no padding, in the writer's byte order. A
+// reader of the other byte order sees the wrong version
+struct ChromaFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;
+    uint32_t bins;
+    uint32_t blockSize;
+    uint32_t hopSize;
+    uint32_t reserved;
+    double sampleRate;
+    double tuningFrequency;
+    uint64_t frameCount;
+    unsigned char padding[8];
+};
+
+static_assert(sizeof(ChromaFileHeader) == 64,
+              "chroma file header must be 64 bytes");
+
+ChromaFile::ChromaFile() :
+    m_file(new MappedFile),
+    m_format(FORMAT_FLOAT32),
+    m_sampleRate(0.0),
+    m_tuningFrequency(0.0),
+    m_blockSize(0),
+    m_hopSize(0),
+    m_frameCount(0)
+{
+}
+
+ChromaFile::~ChromaFile()
+{
+    delete m_file;
+}
+
+bool
+ChromaFile::open(std::string path)
+{
+    close();
+
+    if (!m_file->open(path) || m_file->getSize() < sizeof(ChromaFileHeader)) {
+        close();
+        return false;
+    }
+
+    ChromaFileHeader header;
+    memcpy(&header, m_file->getData(), sizeof(header));
+
+    bool valid =
+        memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+        header.version == kVersion &&
+        (header.format == FORMAT_FLOAT32 ||
+         header.format == FORMAT_FLOAT16) &&
+        header.bins == uint32_t(kBins) &&
+        header.blockSize > 0 && header.hopSize > 0 &&
+        header.sampleRate > 0.0;
+
+    if (valid) {
+        size_t available = (m_file->getSize() - sizeof(header)) /
+            ChromaRecord::getSize(Format(header.format));
+        valid = (header.frameCount <= available);
+    }
+
+    if (!valid) {
+        close();
+        return false;
+    }
+
+    m_format = Format(header.format);
+    m_sampleRate = header.sampleRate;
+    m_tuningFrequency = header.tuningFrequency;
+    m_blockSize = int(header.blockSize);
+    m_hopSize = int(header.hopSize);
+    m_frameCount = size_t(header.frameCount);
+    return true;
+}
+
+void
+ChromaFile::close()
+{
+    m_file->close();
+    m_frameCount = 0;
+}
+
+bool
+ChromaFile::isOpen() const
+{
+    return m_file->getData() != 0;
+}
+
+void
+ChromaFile::readFrame(size_t index, double *chroma) const
+{
+    getFrames().readFrame(index, chroma);
+}
+
+ChromaFrames
+ChromaFile::getFrames() const
+{
+    if (!isOpen()) {
+        return ChromaFrames();
+    }
+    return ChromaFrames(m_file->getData() + sizeof(ChromaFileHeader),
+                        m_frameCount, m_format);
+}
+
+void
+ChromaFrames::readFrame(size_t index, double *chroma) const
+{
+    if (index >= m_count) {
+        for (int i = 0; i < kBins; ++i) {
+            chroma[i] = 0.0;
+        }
+        return;
+    }
+    ChromaRecord::decode(m_records + index * ChromaRecord::getSize(m_format),
+                         m_format, chroma);
+}
+
+const float *
+ChromaFrames::getFloatData() const
+{
+    if (m_format != ChromaFile::FORMAT_FLOAT32) {
+        return 0;
+    }
+    return reinterpret_cast<const float *>(m_records);
+}
+
+ChromaFileWriter::ChromaFileWriter(std::string path,
+                                   KeyDetector::Config config,
+                                   ChromaFile::Format format) :
+    m_frontEnd(0),
+    m_file(0),
+    m_format(format),
+    m_sampleRate(config.sampleRate),
+    m_tuningFrequency(config.tuningFrequency),
+    m_frameCount(0),
+    m_failed(false)
+{
+    // The front end of METHOD_DASCHUER, which does not normalise
+    ChromaFrontEnd::Config fconfig(config.sampleRate);
+    fconfig.tuningFrequency = config.tuningFrequency;
+    fconfig.normalise = MathUtilities::NormaliseNone;
+    fconfig.allocator = config.allocator;
+    m_frontEnd = new ChromaFrontEnd(fconfig);
+
+    m_file = std::fopen(path.c_str(), "wb");
+    if (m_file) {
+        writeHeader();
+    } else {
+        m_failed = true;
+    }
+}
+
+ChromaFileWriter::~ChromaFileWriter()
+{
+    close();
+    delete m_frontEnd;
+}
+
+int
+ChromaFileWriter::getBlockSize() const
+{
+    return m_frontEnd->getBlockSize();
+}
+
+int
+ChromaFileWriter::getHopSize() const
+{
+    return m_frontEnd->getHopSize();
+}
+
+void
+ChromaFileWriter::writeHeader()
+{
+    ChromaFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.format = uint32_t(m_format);
+    header.bins = uint32_t(kBins);
+    header.blockSize = uint32_t(getBlockSize());
+    header.hopSize = uint32_t(getHopSize());
+    header.sampleRate = m_sampleRate;
+    header.tuningFrequency = m_tuningFrequency;
+    header.frameCount = uint64_t(m_frameCount);
+
+    if (std::fseek(m_file, 0, SEEK_SET) != 0 ||
+        std::fwrite(&header, sizeof(header), 1, m_file) != 1) {
+        m_failed = true;
+    }
+}
+
+void
+ChromaFileWriter::writeChroma(const double *chroma)
+{
+    if (!m_file) {
+        return;
+    }
+
+    unsigned char record[ChromaRecord::MaxSize];
+    size_t size = ChromaRecord::getSize(m_format);
+    ChromaRecord::encode(chroma, m_format, record);
+
+    if (std::fwrite(record, size, 1, m_file) != 1) {
+        m_failed = true;
+    }
+    ++m_frameCount;
+}
+
+void
+ChromaFileWriter::process(const double *frame)
+{
+    writeChroma(m_frontEnd->process(frame));
+}
+
+void
+ChromaFileWriter::process(const float *frame)
+{
+    writeChroma(m_frontEnd->process(frame));
+}
+
+void
+ChromaFileWriter::processBuffer(const double *buffer, size_t length)
+{
+    processFrames(buffer, length);
+}
+
+void
+ChromaFileWriter::processBuffer(const float *buffer, size_t length)
+{
+    processFrames(buffer, length);
+}
+
+template <typename T>
+void
+ChromaFileWriter::processFrames(const T *buffer, size_t length)
+{
+    const size_t blockSize = getBlockSize();
+    const size_t hopSize = getHopSize();
+
+    std::vector<T> padded;
+
+    for (size_t offset = 0; offset < length; offset += hopSize) {
+        if (offset + blockSize <= length) {
+            process(buffer + offset);
+        } else {
+            padded.assign(buffer + offset, buffer + length);
+            padded.resize(blockSize, T(0));
+            process(padded.data());
+        }
+    }
+}
+
+bool
+ChromaFileWriter::close()
+{
+    if (!m_file) {
+        return !m_failed;
+    }
+
+    // The frame count was zero when the header was first written
+    writeHeader();
+
+    if (std::fclose(m_file) != 0) {
+        m_failed = true;
+    }
+    m_file = 0;
+
+    return !m_failed;
+}
+
+}
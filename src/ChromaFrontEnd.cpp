@@ -0,0 +1,418 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ChromaFrontEnd.h"
+#include "KernelCache.h"
+#include "Kernels.h"
+#include "Arena.h"
+
+#include "base/Pitch.h"
+#include "dsp/rateconversion/Decimator.h"
+#include "dsp/chromagram/Chromagram.h"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace KD {
+
+static const int kBinsPerOctave = 36;
+
+// The decimated rate must be at least this multiple of the highest
+// chroma frequency, leaving room for the decimation filter's
+// transition band above it
+static const double kMinRateRatio = 2.4;
+
+// Limit on the total decimation factor, however high the input rate
+static const int kMaxDecimationFactor = 64;
+
+int
+ChromaFrontEnd::getDecimationFactor(Config config)
+{
+    double maxFrequency =
+        Pitch::getFrequencyForPitch(96, 0, config.tuningFrequency);
+    double minRate = maxFrequency * kMinRateRatio;
+
+    int factor = 1;
+    while (factor < kMaxDecimationFactor &&
+           config.sampleRate / (factor * 2) >= minRate) {
+        factor *= 2;
+    }
+    return factor;
+}
+
+static ChromaConfig
+makeChromaConfig(ChromaFrontEnd::Config config, int decimationFactor)
+{
+    // Chromagram configuration parameters
+    ChromaConfig cconfig;
+    cconfig.normalise = config.normalise;
+    cconfig.FS = config.sampleRate / (double)decimationFactor;
+    if (cconfig.FS < 1) {
+        cconfig.FS = 1;
+    }
+
+    // Set C3 (= MIDI #48) as our base:
+    // This implies that key = 1 => Cmaj, key = 12 => Bmaj, key = 13 => Cmin, etc.
+    cconfig.min = Pitch::getFrequencyForPitch(48, 0, config.tuningFrequency);
+    // C7 (= MIDI #96) is the exclusive maximum key:
+    cconfig.max = Pitch::getFrequencyForPitch(96, 0, config.tuningFrequency);
+
+    cconfig.BPO = kBinsPerOctave;
+    cconfig.CQThresh = 0.0054;
+
+    return cconfig;
+}
+
+// This is the calculation the Chromagram's ConstantQ makes in sizing
+// its FFT: the shortest power-of-two frame that holds one period of
+// the lowest bin at its Q factor. Its hop is one eighth of that
+static int
+getChromaFrameSizeFor(const ChromaConfig &cconfig)
+{
+    double q = 1.0 / (pow(2.0, 1.0 / (double)cconfig.BPO) - 1.0);
+    double order = ceil(log(ceil(q * cconfig.FS / cconfig.min)) / log(2.0));
+    return (int)pow(2.0, order);
+}
+
+// Average count channels of a multichannel frame, starting at first,
+// into out
+template <typename T>
+static void
+mixChannels(const T *const *channels, int stride, int first, int count,
+            int length, T *out)
+{
+    const T *in = channels[first];
+    for (int i = 0; i < length; ++i) {
+        out[i] = in[i * stride];
+    }
+    for (int c = 1; c < count; ++c) {
+        in = channels[first + c];
+        for (int i = 0; i < length; ++i) {
+            out[i] += in[i * stride];
+        }
+    }
+    if (count > 1) {
+        T scale = T(1.0 / count);
+        for (int i = 0; i < length; ++i) {
+            out[i] *= scale;
+        }
+    }
+}
+
+ChromaFrontEnd::ChromaFrontEnd(Config config, bool sharedArena) :
+    m_config(config),
+    m_decimationFactor(getDecimationFactor(config)),
+    m_stageCount(0),
+    m_chroma(0),
+    m_arena(0),
+    m_decimatedOffset(0),
+    m_decimatedFloatOffset(0),
+    m_mixOffset(0),
+    m_decimatedBuffer(0),
+    m_decimatedFloatBuffer(0),
+    m_mixBuffer(0),
+    m_mixFloatBuffer(0)
+{
+    // Split the decimation into stages each within the range a
+    // single Decimator supports
+    int highest = Decimator::getHighestSupportedFactor();
+    int remaining = m_decimationFactor;
+    while (remaining > 1 && m_stageCount < MaxDecimationStages) {
+        int factor = (remaining > highest ? highest : remaining);
+        m_stageFactors[m_stageCount++] = factor;
+        remaining /= factor;
+    }
+
+    for (int i = 0; i < MaxDecimationStages; ++i) {
+        m_stageOffsets[i] = 0;
+        m_stageFloatOffsets[i] = 0;
+        m_stageBuffers[i] = 0;
+        m_stageFloatBuffers[i] = 0;
+    }
+
+    ChromaConfig cconfig = makeChromaConfig(config, m_decimationFactor);
+    m_decimatedRate = cconfig.FS;
+
+    if (config.chromaInput) {
+        // Sizes only
+        m_stageCount = 0;
+        m_chromaFrameSize = getChromaFrameSizeFor(cconfig);
+        m_chromaHopSize = m_chromaFrameSize / 8;
+        return;
+    }
+
+    // Chromagram inst., reused from an earlier detector if possible
+    m_chroma = KernelCache::acquireChromagram(cconfig);
+
+    // Get calculated parameters from chroma object
+    m_chromaFrameSize = m_chroma->getFrameSize();
+    m_chromaHopSize = m_chroma->getHopSize();
+
+    // The destructor is not called if the constructor throws, so
+    // return everything acquired so far if anything fails
+    try {
+        if (!sharedArena) {
+            m_arena = new Arena(config.allocator);
+            reserve(*m_arena);
+            m_arena->commit();
+            attach(*m_arena);
+        }
+
+        int chains = (config.mixCount == 0 ? config.channels : 1);
+        m_decimators.reserve(size_t(chains) * m_stageCount);
+        for (int c = 0; c < chains; ++c) {
+            int inLength = m_chromaFrameSize * m_decimationFactor;
+            for (int i = 0; i < m_stageCount; ++i) {
+                m_decimators.push_back(KernelCache::acquireDecimator
+                                       (inLength, m_stageFactors[i]));
+                inLength /= m_stageFactors[i];
+            }
+        }
+    } catch (...) {
+        KernelCache::releaseChromagram(m_chroma);
+        for (size_t i = 0; i < m_decimators.size(); ++i) {
+            KernelCache::releaseDecimator(m_decimators[i]);
+        }
+        delete m_arena;
+        throw;
+    }
+}
+
+ChromaFrontEnd::~ChromaFrontEnd()
+{
+    if (m_chroma) {
+        KernelCache::releaseChromagram(m_chroma);
+    }
+    for (size_t i = 0; i < m_decimators.size(); ++i) {
+        KernelCache::releaseDecimator(m_decimators[i]);
+    }
+
+    delete m_arena;
+}
+
+void
+ChromaFrontEnd::reserve(Arena &arena)
+{
+    if (m_config.chromaInput) {
+        return;
+    }
+
+    m_decimatedOffset = arena.reserve<double>(m_chromaFrameSize);
+    m_decimatedFloatOffset = arena.reserve<float>(m_chromaFrameSize);
+
+    for (int i = 0; i + 1 < m_stageCount; ++i) {
+        int length = getStageOutputLength(i);
+        m_stageOffsets[i] = arena.reserve<double>(length);
+        m_stageFloatOffsets[i] = arena.reserve<float>(length);
+    }
+
+    if (needMixBuffer()) {
+        m_mixOffset = arena.reserve<double>(getBlockSize());
+    }
+}
+
+void
+ChromaFrontEnd::attach(const Arena &arena)
+{
+    if (m_config.chromaInput) {
+        return;
+    }
+
+    m_decimatedBuffer = arena.get<double>(m_decimatedOffset);
+    m_decimatedFloatBuffer = arena.get<float>(m_decimatedFloatOffset);
+
+    for (int i = 0; i + 1 < m_stageCount; ++i) {
+        m_stageBuffers[i] = arena.get<double>(m_stageOffsets[i]);
+        m_stageFloatBuffers[i] = arena.get<float>(m_stageFloatOffsets[i]);
+    }
+
+    if (needMixBuffer()) {
+        m_mixBuffer = arena.get<double>(m_mixOffset);
+        m_mixFloatBuffer = reinterpret_cast<float *>(m_mixBuffer);
+    }
+}
+
+bool
+ChromaFrontEnd::needMixBuffer() const
+{
+    if (m_config.channels < 2) {
+        return false;
+    }
+    return !(m_config.planar && m_config.mixCount <= 1);
+}
+
+size_t
+ChromaFrontEnd::getMemorySize() const
+{
+    return m_arena ? m_arena->getSize() : 0;
+}
+
+int
+ChromaFrontEnd::getStageOutputLength(int stage) const
+{
+    int length = m_chromaFrameSize * m_decimationFactor;
+    for (int i = 0; i <= stage; ++i) {
+        length /= m_stageFactors[i];
+    }
+    return length;
+}
+
+void
+ChromaFrontEnd::getSizes(Config config, int &blockSize, int &hopSize)
+{
+    int factor = getDecimationFactor(config);
+    ChromaConfig cconfig = makeChromaConfig(config, factor);
+    int frameSize = getChromaFrameSizeFor(cconfig);
+
+    blockSize = frameSize * factor;
+    hopSize = (frameSize / 8) * factor;
+}
+
+const double *
+ChromaFrontEnd::process(const double *frame)
+{
+    return processChain(frame, 0);
+}
+
+const double *
+ChromaFrontEnd::process(const float *frame)
+{
+    return processChain(frame, 0);
+}
+
+const double *
+ChromaFrontEnd::process(const double *const *channels, int stride)
+{
+    if (m_config.mixCount == 1 && stride == 1) {
+        return processChain(channels[m_config.mixFirst], 0);
+    }
+    mixChannels(channels, stride, m_config.mixFirst, m_config.mixCount,
+                getBlockSize(), m_mixBuffer);
+    return processChain(m_mixBuffer, 0);
+}
+
+const double *
+ChromaFrontEnd::process(const float *const *channels, int stride)
+{
+    if (m_config.mixCount == 1 && stride == 1) {
+        return processChain(channels[m_config.mixFirst], 0);
+    }
+    mixChannels(channels, stride, m_config.mixFirst, m_config.mixCount,
+                getBlockSize(), m_mixFloatBuffer);
+    return processChain(m_mixFloatBuffer, 0);
+}
+
+const double *
+ChromaFrontEnd::processChannel(const double *const *channels, int stride,
+                               int channel)
+{
+    if (stride == 1) {
+        return processChain(channels[channel], channel);
+    }
+    mixChannels(channels, stride, channel, 1, getBlockSize(), m_mixBuffer);
+    return processChain(m_mixBuffer, channel);
+}
+
+const double *
+ChromaFrontEnd::processChannel(const float *const *channels, int stride,
+                               int channel)
+{
+    if (stride == 1) {
+        return processChain(channels[channel], channel);
+    }
+    mixChannels(channels, stride, channel, 1, getBlockSize(),
+                m_mixFloatBuffer);
+    return processChain(m_mixFloatBuffer, channel);
+}
+
+const double *
+ChromaFrontEnd::processChain(const double *frame, int chain)
+{
+    if (!m_chroma) {
+        throw std::logic_error
+            ("front end is configured for chroma input only");
+    }
+
+    if (m_stageCount == 0) {
+        return m_chroma->process(frame);
+    }
+
+    Decimator *const *decimators = &m_decimators[chain * m_stageCount];
+
+    const double *in = frame;
+    for (int i = 0; i + 1 < m_stageCount; ++i) {
+        decimators[i]->process(in, m_stageBuffers[i]);
+        in = m_stageBuffers[i];
+    }
+    decimators[m_stageCount - 1]->process(in, m_decimatedBuffer);
+
+    return m_chroma->process(m_decimatedBuffer);
+}
+
+const double *
+ChromaFrontEnd::processChain(const float *frame, int chain)
+{
+    if (!m_chroma) {
+        throw std::logic_error
+            ("front end is configured for chroma input only");
+    }
+
+    if (m_stageCount == 0) {
+        Kernels::floatToDouble(frame, m_decimatedBuffer, m_chromaFrameSize);
+        return m_chroma->process(m_decimatedBuffer);
+    }
+
+    Decimator *const *decimators = &m_decimators[chain * m_stageCount];
+
+    const float *in = frame;
+    for (int i = 0; i + 1 < m_stageCount; ++i) {
+        decimators[i]->process(in, m_stageFloatBuffers[i]);
+        in = m_stageFloatBuffers[i];
+    }
+    decimators[m_stageCount - 1]->process(in, m_decimatedFloatBuffer);
+
+    Kernels::floatToDouble(m_decimatedFloatBuffer, m_decimatedBuffer,
+                           m_chromaFrameSize);
+
+    return m_chroma->process(m_decimatedBuffer);
+}
+
+void
+ChromaFrontEnd::reset()
+{
+    for (size_t i = 0; i < m_decimators.size(); ++i) {
+        m_decimators[i]->resetFilter();
+    }
+}
+
+int
+ChromaFrontEnd::getBlockSize() const
+{
+    return m_chromaFrameSize * m_decimationFactor;
+}
+
+int
+ChromaFrontEnd::getHopSize() const
+{
+    return m_chromaHopSize * m_decimationFactor;
+}
+
+void
+ChromaFrontEnd::normalise(double *chroma) const
+{
+    MathUtilities::normalise(chroma, kBinsPerOctave, m_config.normalise);
+}
+
+int
+ChromaFrontEnd::getBinsPerOctave() const
+{
+    return kBinsPerOctave;
+}
+
+}
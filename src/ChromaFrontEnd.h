@@ -0,0 +1,252 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_CHROMA_FRONT_END_H
+#define KEY_DETECTOR_CHROMA_FRONT_END_H
+
+#include "maths/MathUtilities.h"
+
+#include <cstddef>
+#include <vector>
+
+class Decimator;
+class Chromagram;
+
+namespace KD {
+
+class Allocator;
+class Arena;
+
+/**
+ * The signal-processing stages shared by both detectors: decimation
+ * of the time-domain input followed by a 36-bin-per-octave constant-Q
+ * chromagram from C3 to C7.
+ *
+ * The decimation factor is the largest power of two that leaves the
+ * top of that pitch range comfortably below the Nyquist frequency,
+ * so the chromagram always runs at between about 5 and 10 kHz and
+ * the cost per second of input is roughly the same at any input
+ * rate. Factors beyond what a single qm-dsp Decimator supports are
+ * reached with a cascade of them.
+ *
+ * The Decimator and Chromagram objects are obtained from the
+ * KernelCache, so constructing a front end with the same
+ * configuration as one destroyed earlier is cheap.
+ *
+ * Multichannel input is either mixed down before decimation or
+ * decimated one channel at a time, each with its own decimators but
+ * all sharing the one chromagram.
+ *
+ * A front end carries decimator filter state from one frame to the
+ * next, but is otherwise independent of the key estimation that
+ * follows it, so several can run on different parts of a signal at
+ * once.
+ */
+class ChromaFrontEnd
+{
+public:
+    struct Config {
+        double sampleRate;
+        double tuningFrequency;
+        MathUtilities::NormaliseType normalise;
+        Allocator *allocator;
+
+        /**
+         * Number of channels given to the multichannel process() and
+         * processChannel(). For process(), they are mixed down by
+         * averaging mixCount channels starting at mixFirst. If
+         * mixCount is zero, they are instead decimated separately
+         * and processChannel() must be used.
+         */
+        int channels;
+        int mixFirst;
+        int mixCount;
+
+        /**
+         * If true, multichannel input will always be planar (with a
+         * stride of 1), so a channel that is not mixed with others
+         * can go straight to its decimator and the front end needs no
+         * buffer to de-interleave it into.
+         */
+        bool planar;
+
+        /**
+         * If true, the front end serves only to report sizes to a
+         * detector that will be given chroma rather than audio. No
+         * decimators, chromagram or buffers are created, and no
+         * process function may be called.
+         */
+        bool chromaInput;
+
+        Config(double _sampleRate) :
+            sampleRate(_sampleRate),
+            tuningFrequency(440.0),
+            normalise(MathUtilities::NormaliseNone),
+            allocator(0),
+            channels(1),
+            mixFirst(0),
+            mixCount(1),
+            planar(false),
+            chromaInput(false) {
+        }
+    };
+
+    /**
+     * Construct a front end, allocating its working buffers from
+     * config.allocator. If sharedArena is true, no buffers are
+     * allocated; instead the owner must lay them out in its own arena
+     * with reserve() and attach() before calling process().
+     */
+    ChromaFrontEnd(Config config, bool sharedArena = false);
+    ~ChromaFrontEnd();
+
+    /**
+     * Reserve space for the working buffers in the given arena.
+     */
+    void reserve(Arena &arena);
+
+    /**
+     * Take the working buffers from the space previously reserved in
+     * the given arena, which must since have been committed.
+     */
+    void attach(const Arena &arena);
+
+    /**
+     * Calculate the block and hop sizes that a front end with the
+     * given configuration would have, without constructing one.
+     */
+    static void getSizes(Config config, int &blockSize, int &hopSize);
+
+    Config getConfig() const { return m_config; }
+
+    /**
+     * Process a single time-domain input frame of length
+     * getBlockSize() and return a pointer to getBinsPerOctave()
+     * chroma values, valid until the next call.
+     */
+    const double *process(const double *frame);
+
+    /**
+     * Process a single-precision input frame, as above. The frame is
+     * decimated in single precision and only the decimated signal is
+     * converted to double.
+     */
+    const double *process(const float *frame);
+
+    /**
+     * Process a frame of getBlockSize() samples in each of
+     * config.channels channels, mixing them down as configured.
+     * Sample i of channel c is at channels[c][i * stride], so planar
+     * input has a stride of 1 and interleaved input a stride of the
+     * channel count, with channels[c] pointing to the first sample of
+     * channel c.
+     */
+    const double *process(const double *const *channels, int stride);
+    const double *process(const float *const *channels, int stride);
+
+    /**
+     * Process only the given channel of a multichannel frame laid out
+     * as for process(), using that channel's own decimators. Only
+     * valid if config.mixCount is zero. The returned chroma is valid
+     * until the next call for any channel.
+     */
+    const double *processChannel(const double *const *channels, int stride,
+                                 int channel);
+    const double *processChannel(const float *const *channels, int stride,
+                                 int channel);
+
+    /**
+     * Apply the configured normalisation, in place, to a chroma
+     * vector of getBinsPerOctave() values calculated without any,
+     * such as one read from a ChromaFile. This may be used in
+     * chromaInput mode.
+     */
+    void normalise(double *chroma) const;
+
+    /**
+     * Clear the decimator's filter history.
+     */
+    void reset();
+
+    int getBlockSize() const;
+    int getHopSize() const;
+
+    int getChromaFrameSize() const { return m_chromaFrameSize; }
+    int getChromaHopSize() const { return m_chromaHopSize; }
+    int getBinsPerOctave() const;
+    int getDecimationFactor() const { return m_decimationFactor; }
+
+    /**
+     * Return the decimation factor a front end with the given
+     * configuration would use.
+     */
+    static int getDecimationFactor(Config config);
+    double getDecimatedSampleRate() const { return m_decimatedRate; }
+
+    /**
+     * Return the number of bytes allocated for working buffers, if
+     * the front end has its own arena, or 0 if they are in its
+     * owner's.
+     */
+    size_t getMemorySize() const;
+
+private:
+    Config m_config;
+
+    int m_decimationFactor;
+    double m_decimatedRate;
+
+    // Decimation stages, applied in order; none if the factor is 1.
+    // There is one chain of decimators for each separately decimated
+    // channel, or just one if channels are mixed, stored chain by
+    // chain
+    enum { MaxDecimationStages = 3 };
+    int m_stageCount;
+    int m_stageFactors[MaxDecimationStages];
+    std::vector<Decimator *> m_decimators;
+
+    Chromagram *m_chroma;
+
+    int m_chromaFrameSize;
+    int m_chromaHopSize;
+
+    Arena *m_arena;
+    size_t m_decimatedOffset;
+    size_t m_decimatedFloatOffset;
+    size_t m_stageOffsets[MaxDecimationStages];
+    size_t m_stageFloatOffsets[MaxDecimationStages];
+    size_t m_mixOffset;
+
+    double *m_decimatedBuffer;
+    float *m_decimatedFloatBuffer;
+
+    // One block of mixed or de-interleaved input, if channels > 1.
+    // The float buffer shares the double one's storage, as only one
+    // is in use at a time
+    double *m_mixBuffer;
+    float *m_mixFloatBuffer;
+
+    // Output of each stage but the last, which writes to the
+    // decimated buffers above
+    double *m_stageBuffers[MaxDecimationStages];
+    float *m_stageFloatBuffers[MaxDecimationStages];
+
+    int getStageOutputLength(int stage) const;
+    bool needMixBuffer() const;
+
+    const double *processChain(const double *frame, int chain);
+    const double *processChain(const float *frame, int chain);
+
+    ChromaFrontEnd(const ChromaFrontEnd &); // not provided
+    ChromaFrontEnd &operator=(const ChromaFrontEnd &); // not provided
+};
+
+}
+
+#endif
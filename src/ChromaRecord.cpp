@@ -0,0 +1,154 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ChromaRecord.h"
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+namespace KD {
+
+static const int kBins = ChromaFile::BinsPerOctave;
+
+// IEEE half precision, rounding to nearest even
+
+static uint16_t
+floatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint16_t sign = uint16_t((x >> 16) & 0x8000);
+    uint32_t mantissa = x & 0x7fffff;
+    int exponent = int((x >> 23) & 0xff) - 127 + 15;
+
+    if (exponent >= 31) {
+        bool nan = ((x >> 23) & 0xff) == 0xff && mantissa != 0;
+        return uint16_t(sign | (nan ? 0x7e00 : 0x7c00));
+    }
+
+    uint32_t half, remainder, midpoint;
+
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        // Subnormal in half precision
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        half = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        midpoint = 1u << (shift - 1);
+    } else {
+        half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+        remainder = mantissa & 0x1fff;
+        midpoint = 0x1000;
+    }
+
+    // A carry out of the mantissa correctly increments the exponent
+    if (remainder > midpoint || (remainder == midpoint && (half & 1))) {
+        ++half;
+    }
+
+    return uint16_t(sign | half);
+}
+
+static float
+halfToFloat(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    int exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+
+    if (exponent == 31) {
+        x = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent == 0 && mantissa == 0) {
+        x = sign;
+    } else {
+        if (exponent == 0) {
+            // Subnormal in half precision, normal in single
+            exponent = 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            mantissa &= 0x3ff;
+        }
+        x = sign | (uint32_t(exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+size_t
+ChromaRecord::getSize(ChromaFile::Format format)
+{
+    if (format == ChromaFile::FORMAT_FLOAT16) {
+        return sizeof(float) + kBins * sizeof(uint16_t);
+    } else {
+        return kBins * sizeof(float);
+    }
+}
+
+void
+ChromaRecord::encode(const double *chroma, ChromaFile::Format format,
+                     unsigned char *record)
+{
+    if (format == ChromaFile::FORMAT_FLOAT16) {
+        // Scale to unit maximum so that the full precision of the
+        // half-precision values is used however quiet the input
+        double peak = 0.0;
+        for (int i = 0; i < kBins; ++i) {
+            if (fabs(chroma[i]) > peak) {
+                peak = fabs(chroma[i]);
+            }
+        }
+        float scale = float(peak);
+        uint16_t values[kBins];
+        for (int i = 0; i < kBins; ++i) {
+            values[i] = (scale > 0.f ? floatToHalf(float(chroma[i] / scale))
+                         : 0);
+        }
+        memcpy(record, &scale, sizeof(scale));
+        memcpy(record + sizeof(scale), values, sizeof(values));
+    } else {
+        float values[kBins];
+        for (int i = 0; i < kBins; ++i) {
+            values[i] = float(chroma[i]);
+        }
+        memcpy(record, values, sizeof(values));
+    }
+}
+
+void
+ChromaRecord::decode(const unsigned char *record, ChromaFile::Format format,
+                     double *chroma)
+{
+    if (format == ChromaFile::FORMAT_FLOAT16) {
+        float scale;
+        uint16_t values[kBins];
+        memcpy(&scale, record, sizeof(scale));
+        memcpy(values, record + sizeof(scale), sizeof(values));
+        for (int i = 0; i < kBins; ++i) {
+            chroma[i] = double(halfToFloat(values[i])) * scale;
+        }
+    } else {
+        float values[kBins];
+        memcpy(values, record, sizeof(values));
+        for (int i = 0; i < kBins; ++i) {
+            chroma[i] = values[i];
+        }
+    }
+}
+
+}
@@ -0,0 +1,52 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_CHROMA_RECORD_H
+#define KEY_DETECTOR_CHROMA_RECORD_H
+
+#include "keydetector/ChromaFile.h"
+
+namespace KD {
+
+/**
+ * The stored form of one chroma vector, shared by ChromaFile and
+ * ChromaStore; see ChromaFile for the layout of each format. Every
+ * record size is a multiple of four bytes, so records written from a
+ * four-byte boundary keep their floats aligned.
+ */
+class ChromaRecord
+{
+public:
+    /**
+     * Return the size in bytes of a record in the given format.
+     */
+    static size_t getSize(ChromaFile::Format format);
+
+    /**
+     * Encode ChromaFile::BinsPerOctave unnormalised values into a
+     * record of getSize(format) bytes.
+     */
+    static void encode(const double *chroma, ChromaFile::Format format,
+                       unsigned char *record);
+
+    /**
+     * Decode a record into ChromaFile::BinsPerOctave values.
+     */
+    static void decode(const unsigned char *record,
+                       ChromaFile::Format format, double *chroma);
+
+    /**
+     * The largest record size of any format.
+     */
+    enum { MaxSize = ChromaFile::BinsPerOctave * 4 };
+};
+
+}
+
+#endif
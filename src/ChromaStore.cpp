@@ -0,0 +1,682 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "keydetector/ChromaStore.h"
+
+#include "ChromaFrontEnd.h"
+#include "ChromaRecord.h"
+#include "MappedFile.h"
+
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+namespace KD {
+
+static const char kMagic[8] = { 'K', 'D', 'C', 'S', 'T', 'O', 'R', 'E' };
+static const uint32_t kVersion = 1;
+static const int kBins = ChromaFile::BinsPerOctave;
+
+// Tracks taken by a scanning thread at a time
+static const size_t kScanRun = 16;
+
+// As for ChromaFile, in the writer's byte order
+struct ChromaStoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;
+    uint32_t bins;
+    uint32_t blockSize;
+    uint32_t hopSize;
+    uint32_t reserved;
+    double sampleRate;
+    double tuningFrequency;
+    uint64_t trackCount;
+    uint64_t indexOffset;
+};
+
+static_assert(sizeof(ChromaStoreHeader) == 64,
+              "chroma store header must be 64 bytes");
+
+// The index starts on an eight-byte boundary so that its columns can
+// be used in place. Track data needs only the four-byte alignment of
+// the floats in its records, which every record size preserves, so
+// tracks follow one another unpadded and only the first track after
+// each index is eight-byte aligned
+static uint64_t
+align(uint64_t offset)
+{
+    return (offset + 7) & ~uint64_t(7);
+}
+
+// Size of the fixed-width index columns for the given track count
+static uint64_t
+getColumnsSize(uint64_t tracks)
+{
+    return (4 * tracks + 1) * sizeof(uint64_t);
+}
+
+static bool
+isValidHeader(const ChromaStoreHeader &header)
+{
+    return memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+        header.version == kVersion &&
+        (header.format == ChromaFile::FORMAT_FLOAT32 ||
+         header.format == ChromaFile::FORMAT_FLOAT16) &&
+        header.bins == uint32_t(kBins) &&
+        header.blockSize > 0 && header.hopSize > 0 &&
+        header.sampleRate > 0.0 &&
+        header.indexOffset % 8 == 0 &&
+        header.indexOffset >= sizeof(ChromaStoreHeader);
+}
+
+ChromaStore::ChromaStore() :
+    m_file(new MappedFile),
+    m_format(ChromaFile::FORMAT_FLOAT32),
+    m_sampleRate(0.0),
+    m_tuningFrequency(0.0),
+    m_blockSize(0),
+    m_hopSize(0),
+    m_trackCount(0),
+    m_dataOffsets(0),
+    m_frameCounts(0),
+    m_idOffsets(0),
+    m_byId(0),
+    m_ids(0)
+{
+}
+
+ChromaStore::~ChromaStore()
+{
+    delete m_file;
+}
+
+bool
+ChromaStore::open(std::string path)
+{
+    close();
+
+    if (!m_file->open(path) ||
+        m_file->getSize() < sizeof(ChromaStoreHeader)) {
+        close();
+        return false;
+    }
+
+    const unsigned char *data = m_file->getData();
+    const uint64_t size = m_file->getSize();
+
+    ChromaStoreHeader header;
+    memcpy(&header, data, sizeof(header));
+
+    if (!isValidHeader(header) ||
+        header.indexOffset > size ||
+        header.trackCount > (size - header.indexOffset) / 32) {
+        close();
+        return false;
+    }
+
+    const uint64_t n = header.trackCount;
+    const uint64_t columnsEnd = header.indexOffset + getColumnsSize(n);
+    if (columnsEnd > size) {
+        close();
+        return false;
+    }
+
+    const uint64_t *columns =
+        reinterpret_cast<const uint64_t *>(data + header.indexOffset);
+    const uint64_t *dataOffsets = columns;
+    const uint64_t *frameCounts = columns + n;
+    const uint64_t *idOffsets = columns + 2 * n;
+    const uint64_t *byId = columns + 3 * n + 1;
+
+    // Check everything the accessors rely on, so that they need not
+    const uint64_t recordSize =
+        ChromaRecord::getSize(ChromaFile::Format(header.format));
+    bool valid = (idOffsets[0] == 0 && idOffsets[n] <= size - columnsEnd);
+    for (uint64_t i = 0; valid && i < n; ++i) {
+        valid =
+            idOffsets[i] <= idOffsets[i + 1] &&
+            byId[i] < n &&
+            dataOffsets[i] % 4 == 0 &&
+            dataOffsets[i] >= sizeof(ChromaStoreHeader) &&
+            dataOffsets[i] <= header.indexOffset &&
+            frameCounts[i] <=
+            (header.indexOffset - dataOffsets[i]) / recordSize;
+    }
+
+    if (!valid) {
+        close();
+        return false;
+    }
+
+    m_format = ChromaFile::Format(header.format);
+    m_sampleRate = header.sampleRate;
+    m_tuningFrequency = header.tuningFrequency;
+    m_blockSize = int(header.blockSize);
+    m_hopSize = int(header.hopSize);
+
+    m_trackCount = size_t(n);
+    m_dataOffsets = dataOffsets;
+    m_frameCounts = frameCounts;
+    m_idOffsets = idOffsets;
+    m_byId = byId;
+    m_ids = reinterpret_cast<const char *>(data + columnsEnd);
+
+    return true;
+}
+
+void
+ChromaStore::close()
+{
+    m_file->close();
+    m_trackCount = 0;
+    m_dataOffsets = 0;
+    m_frameCounts = 0;
+    m_idOffsets = 0;
+    m_byId = 0;
+    m_ids = 0;
+}
+
+bool
+ChromaStore::isOpen() const
+{
+    return m_file->getData() != 0;
+}
+
+std::string
+ChromaStore::getTrackId(size_t track) const
+{
+    if (track >= m_trackCount) {
+        return std::string();
+    }
+    return std::string(m_ids + m_idOffsets[track],
+                       size_t(m_idOffsets[track + 1] - m_idOffsets[track]));
+}
+
+bool
+ChromaStore::findTrack(std::string id, size_t &track) const
+{
+    // Ordered as std::string orders them, as the writer's map does
+    size_t lo = 0, hi = m_trackCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t t = size_t(m_byId[mid]);
+        int c = id.compare(0, std::string::npos, m_ids + m_idOffsets[t],
+                           size_t(m_idOffsets[t + 1] - m_idOffsets[t]));
+        if (c == 0) {
+            track = t;
+            return true;
+        }
+        if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return false;
+}
+
+ChromaFrames
+ChromaStore::getFrames(size_t track) const
+{
+    if (track >= m_trackCount) {
+        return ChromaFrames();
+    }
+    return ChromaFrames(m_file->getData() + m_dataOffsets[track],
+                        size_t(m_frameCounts[track]), m_format);
+}
+
+struct Scan {
+    const ChromaStore *store;
+    ChromaStore::ScanFunction function;
+    std::atomic<size_t> next;
+    size_t count;
+    std::atomic<bool> failed;
+    std::vector<std::exception_ptr> errors; // one per thread
+
+    Scan(int threads) :
+        store(0), next(0), count(0), failed(false), errors(threads) { }
+};
+
+static void
+runScan(Scan *scan, int thread)
+{
+    // An exception stops every thread at its next run of tracks and
+    // is rethrown by scan() once all have finished
+    try {
+        while (!scan->failed) {
+            size_t first = scan->next.fetch_add(kScanRun);
+            if (first >= scan->count) {
+                return;
+            }
+            size_t last = first + kScanRun;
+            if (last > scan->count) {
+                last = scan->count;
+            }
+            for (size_t track = first; track < last; ++track) {
+                scan->function(track, scan->store->getFrames(track), thread);
+            }
+        }
+    } catch (...) {
+        scan->errors[thread] = std::current_exception();
+        scan->failed = true;
+    }
+}
+
+static int
+getThreadCount(int threads)
+{
+    if (threads <= 0) {
+        threads = int(std::thread::hardware_concurrency());
+    }
+    return threads > 0 ? threads : 1;
+}
+
+void
+ChromaStore::scan(ScanFunction function, int threads) const
+{
+    threads = getThreadCount(threads);
+    if (size_t(threads) > m_trackCount) {
+        threads = int(m_trackCount);
+    }
+    if (threads == 0) {
+        return;
+    }
+
+    Scan scan(threads);
+    scan.store = this;
+    scan.function = function;
+    scan.count = m_trackCount;
+
+    std::vector<std::thread> workers;
+    try {
+        for (int i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(runScan, &scan, i));
+        }
+    } catch (...) {
+        scan.errors[0] = std::current_exception();
+        scan.failed = true;
+    }
+
+    // The calling thread does its share too
+    runScan(&scan, 0);
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    for (int i = 0; i < threads; ++i) {
+        if (scan.errors[i]) {
+            std::rethrow_exception(scan.errors[i]);
+        }
+    }
+}
+
+// State shared by the threads of ChromaStore::analyse()
+struct StoreAnalysis {
+    std::vector<std::unique_ptr<KeyDetector> > detectors;
+    ChromaStore::AnalysisCallback callback;
+    std::mutex callbackMutex;
+};
+
+static void
+analyseTrack(StoreAnalysis *state, size_t track, const ChromaFrames &frames,
+             int thread)
+{
+    KeyDetector *detector = state->detectors[thread].get();
+    detector->reset();
+    KeyDetector::Analysis analysis = detector->analyseChroma(frames);
+
+    std::lock_guard<std::mutex> guard(state->callbackMutex);
+    state->callback(track, analysis);
+}
+
+void
+ChromaStore::analyse(KeyDetector::Config config, AnalysisCallback callback,
+                     int threads) const
+{
+    if (!isOpen()) {
+        throw std::logic_error("chroma store is not open");
+    }
+    if (m_sampleRate != config.sampleRate ||
+        m_tuningFrequency != config.tuningFrequency) {
+        throw std::logic_error
+            ("chroma store sample rate or tuning frequency differs from "
+             "configuration");
+    }
+
+    // Build no more detectors than scan() will use threads, as each
+    // has its own kernels
+    config.chromaInput = true;
+    threads = getThreadCount(threads);
+    if (size_t(threads) > m_trackCount) {
+        threads = int(m_trackCount);
+    }
+    if (threads == 0) {
+        return;
+    }
+
+    StoreAnalysis analysis;
+    analysis.callback = callback;
+    analysis.detectors.resize(threads);
+    for (int i = 0; i < threads; ++i) {
+        analysis.detectors[i].reset(new KeyDetector(config));
+    }
+
+    using namespace std::placeholders;
+    scan(std::bind(analyseTrack, &analysis, _1, _2, _3), threads);
+}
+
+ChromaStoreWriter::ChromaStoreWriter(std::string path,
+                                     KeyDetector::Config config,
+                                     ChromaFile::Format format) :
+    m_frontEnd(0),
+    m_file(0),
+    m_format(format),
+    m_sampleRate(config.sampleRate),
+    m_tuningFrequency(config.tuningFrequency),
+    m_failed(false),
+    m_end(sizeof(ChromaStoreHeader)),
+    m_committed(0)
+{
+    // Unnormalised, as for ChromaFileWriter
+    ChromaFrontEnd::Config fconfig(config.sampleRate);
+    fconfig.tuningFrequency = config.tuningFrequency;
+    fconfig.normalise = MathUtilities::NormaliseNone;
+    fconfig.allocator = config.allocator;
+    m_frontEnd = new ChromaFrontEnd(fconfig);
+
+    m_file = std::fopen(path.c_str(), "r+b");
+    if (m_file) {
+        if (!load()) {
+            m_failed = true;
+        }
+        return;
+    }
+
+    m_file = std::fopen(path.c_str(), "w+b");
+    if (!m_file) {
+        m_failed = true;
+        return;
+    }
+
+    // An empty store
+    writeIndex();
+}
+
+ChromaStoreWriter::~ChromaStoreWriter()
+{
+    if (m_file) {
+        commit();
+        std::fclose(m_file);
+    }
+    delete m_frontEnd;
+}
+
+bool
+ChromaStoreWriter::seek(uint64_t offset)
+{
+#ifdef _WIN32
+    int rv = _fseeki64(m_file, __int64(offset), SEEK_SET);
+#else
+    int rv = fseeko(m_file, off_t(offset), SEEK_SET);
+#endif
+    if (rv != 0) {
+        m_failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool
+ChromaStoreWriter::write(const void *data, size_t size)
+{
+    if (size > 0 && std::fwrite(data, size, 1, m_file) != 1) {
+        m_failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool
+ChromaStoreWriter::load()
+{
+    ChromaStoreHeader header;
+    if (!seek(0) || std::fread(&header, sizeof(header), 1, m_file) != 1 ||
+        !isValidHeader(header) ||
+        header.format != uint32_t(m_format) ||
+        header.sampleRate != m_sampleRate ||
+        header.tuningFrequency != m_tuningFrequency ||
+        header.blockSize != uint32_t(m_frontEnd->getBlockSize()) ||
+        header.hopSize != uint32_t(m_frontEnd->getHopSize())) {
+        return false;
+    }
+
+    size_t n = size_t(header.trackCount);
+    std::vector<uint64_t> idOffsets(n + 1);
+    m_dataOffsets.resize(n);
+    m_frameCounts.resize(n);
+
+    if (!seek(header.indexOffset) ||
+        std::fread(m_dataOffsets.data(), sizeof(uint64_t), n, m_file) != n ||
+        std::fread(m_frameCounts.data(), sizeof(uint64_t), n, m_file) != n ||
+        std::fread(idOffsets.data(), sizeof(uint64_t), n + 1, m_file) !=
+        n + 1 ||
+        !seek(header.indexOffset + getColumnsSize(n))) {
+        return false;
+    }
+
+    std::vector<char> ids(size_t(idOffsets[n]));
+    if (!ids.empty() &&
+        std::fread(ids.data(), ids.size(), 1, m_file) != 1) {
+        return false;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (idOffsets[i] > idOffsets[i + 1] || idOffsets[i + 1] > ids.size()) {
+            return false;
+        }
+        std::string id(ids.data() + idOffsets[i],
+                       size_t(idOffsets[i + 1] - idOffsets[i]));
+        std::pair<std::map<std::string, size_t>::iterator, bool> r =
+            m_tracksById.insert(std::make_pair(id, i));
+        m_idsByTrack.push_back(&r.first->first);
+    }
+
+    // Anything after the current index was left by an interrupted
+    // writer and is not referred to, so may be overwritten
+    m_committed = n;
+    m_end = align(header.indexOffset + getColumnsSize(n) + ids.size());
+    return true;
+}
+
+bool
+ChromaStoreWriter::writeIndex()
+{
+    size_t n = m_dataOffsets.size();
+    uint64_t indexOffset = align(m_end);
+
+    std::vector<uint64_t> idOffsets(n + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+        idOffsets[i + 1] = idOffsets[i] + m_idsByTrack[i]->size();
+    }
+
+    std::vector<uint64_t> byId;
+    byId.reserve(n);
+    for (std::map<std::string, size_t>::const_iterator i =
+             m_tracksById.begin(); i != m_tracksById.end(); ++i) {
+        byId.push_back(i->second);
+    }
+
+    if (!seek(indexOffset) ||
+        !write(m_dataOffsets.data(), n * sizeof(uint64_t)) ||
+        !write(m_frameCounts.data(), n * sizeof(uint64_t)) ||
+        !write(idOffsets.data(), (n + 1) * sizeof(uint64_t)) ||
+        !write(byId.data(), n * sizeof(uint64_t))) {
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (!write(m_idsByTrack[i]->data(), m_idsByTrack[i]->size())) {
+            return false;
+        }
+    }
+
+    // The index must be complete before the header refers to it
+    if (std::fflush(m_file) != 0) {
+        m_failed = true;
+        return false;
+    }
+
+    ChromaStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.format = uint32_t(m_format);
+    header.bins = uint32_t(kBins);
+    header.blockSize = uint32_t(m_frontEnd->getBlockSize());
+    header.hopSize = uint32_t(m_frontEnd->getHopSize());
+    header.sampleRate = m_sampleRate;
+    header.tuningFrequency = m_tuningFrequency;
+    header.trackCount = uint64_t(n);
+    header.indexOffset = indexOffset;
+
+    if (!seek(0) || !write(&header, sizeof(header)) ||
+        std::fflush(m_file) != 0) {
+        m_failed = true;
+        return false;
+    }
+
+    m_committed = n;
+    m_end = align(indexOffset + getColumnsSize(n) + idOffsets[n]);
+    return true;
+}
+
+bool
+ChromaStoreWriter::commit()
+{
+    if (!m_file || m_failed) {
+        return false;
+    }
+    if (m_committed == m_dataOffsets.size()) {
+        return true;
+    }
+    return writeIndex();
+}
+
+bool
+ChromaStoreWriter::beginTrack(std::string id)
+{
+    if (!m_file || m_failed) {
+        return false;
+    }
+    if (m_tracksById.find(id) != m_tracksById.end()) {
+        return false;
+    }
+    return seek(m_end);
+}
+
+void
+ChromaStoreWriter::endTrack(std::string id, size_t frames)
+{
+    size_t track = m_dataOffsets.size();
+    m_dataOffsets.push_back(m_end);
+    m_frameCounts.push_back(frames);
+
+    std::pair<std::map<std::string, size_t>::iterator, bool> r =
+        m_tracksById.insert(std::make_pair(id, track));
+    m_idsByTrack.push_back(&r.first->first);
+
+    m_end += uint64_t(frames) * ChromaRecord::getSize(m_format);
+}
+
+bool
+ChromaStoreWriter::addTrack(std::string id, const double *buffer,
+                            size_t length)
+{
+    return addFrames(id, buffer, length);
+}
+
+bool
+ChromaStoreWriter::addTrack(std::string id, const float *buffer,
+                            size_t length)
+{
+    return addFrames(id, buffer, length);
+}
+
+template <typename T>
+bool
+ChromaStoreWriter::addFrames(std::string id, const T *buffer, size_t length)
+{
+    if (!beginTrack(id)) {
+        return false;
+    }
+
+    // Each track is analysed from a clean filter state, as by a
+    // fresh detector
+    m_frontEnd->reset();
+
+    const size_t blockSize = m_frontEnd->getBlockSize();
+    const size_t hopSize = m_frontEnd->getHopSize();
+    const size_t recordSize = ChromaRecord::getSize(m_format);
+
+    unsigned char record[ChromaRecord::MaxSize];
+    std::vector<T> padded;
+    size_t frames = 0;
+
+    for (size_t offset = 0; offset < length; offset += hopSize) {
+        const T *block = buffer + offset;
+        if (offset + blockSize > length) {
+            padded.assign(buffer + offset, buffer + length);
+            padded.resize(blockSize, T(0));
+            block = padded.data();
+        }
+        ChromaRecord::encode(m_frontEnd->process(block), m_format, record);
+        if (!write(record, recordSize)) {
+            return false;
+        }
+        ++frames;
+    }
+
+    endTrack(id, frames);
+    return true;
+}
+
+bool
+ChromaStoreWriter::addTrack(std::string id, const ChromaFrames &frames)
+{
+    if (!beginTrack(id)) {
+        return false;
+    }
+
+    const size_t recordSize = ChromaRecord::getSize(m_format);
+
+    unsigned char record[ChromaRecord::MaxSize];
+    double chroma[kBins];
+    size_t count = frames.getFrameCount();
+
+    for (size_t i = 0; i < count; ++i) {
+        frames.readFrame(i, chroma);
+        ChromaRecord::encode(chroma, m_format, record);
+        if (!write(record, recordSize)) {
+            return false;
+        }
+    }
+
+    endTrack(id, count);
+    return true;
+}
+
+}
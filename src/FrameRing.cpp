@@ -0,0 +1,64 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "FrameRing.h"
+
+namespace KD {
+
+FrameRing::FrameRing(int blockSize, int hopSize) :
+    m_blockSize(blockSize),
+    m_hopSize(hopSize),
+    m_capacity(blockSize + hopSize),
+    m_readIndex(0),
+    m_writeIndex(0),
+    m_fill(0),
+    m_buffer(m_capacity * 2, 0.f)
+{
+}
+
+size_t
+FrameRing::write(const float *samples, size_t count)
+{
+    size_t space = m_capacity - m_fill;
+    if (count > space) {
+        count = space;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        float sample = samples[i];
+        m_buffer[m_writeIndex] = sample;
+        m_buffer[m_writeIndex + m_capacity] = sample;
+        if (++m_writeIndex == m_capacity) {
+            m_writeIndex = 0;
+        }
+    }
+
+    m_fill += count;
+    return count;
+}
+
+void
+FrameRing::advance()
+{
+    m_readIndex += m_hopSize;
+    if (m_readIndex >= m_capacity) {
+        m_readIndex -= m_capacity;
+    }
+    m_fill -= m_hopSize;
+}
+
+void
+FrameRing::reset()
+{
+    m_readIndex = 0;
+    m_writeIndex = 0;
+    m_fill = 0;
+}
+
+}
@@ -0,0 +1,78 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_FRAME_RING_H
+#define KEY_DETECTOR_FRAME_RING_H
+
+#include <vector>
+#include <cstddef>
+
+namespace KD {
+
+/**
+ * Ring buffer that accepts input in chunks of any size and hands out
+ * overlapping blocks of a fixed size, advancing by a fixed hop.
+ *
+ * Every sample is stored twice, half a buffer apart, so that any
+ * block starting within the ring is contiguous in memory and can be
+ * passed straight to a detector without copying the overlap.
+ *
+ * All storage is allocated on construction. The ring is for use
+ * from a single thread: the fill level is updated by both write()
+ * and advance(), so writing and reading must not happen
+ * concurrently. See SPSCRing for a ring that may be shared between
+ * two threads.
+ */
+class FrameRing
+{
+public:
+    FrameRing(int blockSize, int hopSize);
+
+    /**
+     * Append up to count samples, returning the number actually
+     * written. Fewer than count are written only if the ring is full,
+     * in which case the caller should consume blocks and try again.
+     */
+    size_t write(const float *samples, size_t count);
+
+    /**
+     * Return true if a complete block is available for reading.
+     */
+    bool haveBlock() const { return m_fill >= m_blockSize; }
+
+    /**
+     * Return the block at the current read position. Only valid if
+     * haveBlock() returns true.
+     */
+    const float *getBlock() const { return &m_buffer[m_readIndex]; }
+
+    /**
+     * Discard one hop's worth of samples from the read position.
+     */
+    void advance();
+
+    void reset();
+
+    size_t getMemorySize() const {
+        return m_buffer.size() * sizeof(float);
+    }
+
+private:
+    size_t m_blockSize;
+    size_t m_hopSize;
+    size_t m_capacity;
+    size_t m_readIndex;
+    size_t m_writeIndex;
+    size_t m_fill;
+    std::vector<float> m_buffer;
+};
+
+}
+
+#endif
@@ -0,0 +1,182 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "KernelCache.h"
+
+#include "dsp/rateconversion/Decimator.h"
+#include "dsp/chromagram/Chromagram.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace KD {
+
+namespace {
+
+struct ChromaKey {
+    double fs;
+    double min;
+    double max;
+    int bpo;
+    double thresh;
+    int normalise;
+
+    ChromaKey(const ChromaConfig &c) :
+        fs(c.FS), min(c.min), max(c.max), bpo(c.BPO),
+        thresh(c.CQThresh), normalise(int(c.normalise)) { }
+
+    bool operator<(const ChromaKey &k) const {
+        if (fs != k.fs) return fs < k.fs;
+        if (min != k.min) return min < k.min;
+        if (max != k.max) return max < k.max;
+        if (bpo != k.bpo) return bpo < k.bpo;
+        if (thresh != k.thresh) return thresh < k.thresh;
+        return normalise < k.normalise;
+    }
+};
+
+typedef std::pair<int, int> DecimatorKey;
+
+struct Cache {
+    std::mutex mutex;
+    std::map<ChromaKey, std::vector<Chromagram *> > idleChroma;
+    std::map<Chromagram *, ChromaKey> busyChroma;
+    std::map<DecimatorKey, std::vector<Decimator *> > idleDecimators;
+    std::map<Decimator *, DecimatorKey> busyDecimators;
+};
+
+// Never destroyed, so that detectors with static storage duration
+// can safely release their objects during shutdown
+Cache &
+getCache()
+{
+    static Cache *cache = new Cache;
+    return *cache;
+}
+
+}
+
+Chromagram *
+KernelCache::acquireChromagram(const ChromaConfig &config)
+{
+    Cache &cache = getCache();
+    ChromaKey key(config);
+
+    {
+        std::lock_guard<std::mutex> guard(cache.mutex);
+        std::vector<Chromagram *> &idle = cache.idleChroma[key];
+        if (!idle.empty()) {
+            Chromagram *chroma = idle.back();
+            idle.pop_back();
+            cache.busyChroma.insert(std::make_pair(chroma, key));
+            return chroma;
+        }
+    }
+
+    // Build the kernel without holding the lock
+    Chromagram *chroma = new Chromagram(config);
+
+    std::lock_guard<std::mutex> guard(cache.mutex);
+    cache.busyChroma.insert(std::make_pair(chroma, key));
+    return chroma;
+}
+
+void
+KernelCache::releaseChromagram(Chromagram *chroma)
+{
+    if (!chroma) return;
+
+    Cache &cache = getCache();
+    std::lock_guard<std::mutex> guard(cache.mutex);
+
+    std::map<Chromagram *, ChromaKey>::iterator i =
+        cache.busyChroma.find(chroma);
+    if (i == cache.busyChroma.end()) {
+        delete chroma;
+        return;
+    }
+
+    cache.idleChroma[i->second].push_back(chroma);
+    cache.busyChroma.erase(i);
+}
+
+Decimator *
+KernelCache::acquireDecimator(int inLength, int factor)
+{
+    Cache &cache = getCache();
+    DecimatorKey key(inLength, factor);
+
+    {
+        std::lock_guard<std::mutex> guard(cache.mutex);
+        std::vector<Decimator *> &idle = cache.idleDecimators[key];
+        if (!idle.empty()) {
+            Decimator *decimator = idle.back();
+            idle.pop_back();
+            cache.busyDecimators.insert(std::make_pair(decimator, key));
+            decimator->resetFilter();
+            return decimator;
+        }
+    }
+
+    Decimator *decimator = new Decimator(inLength, factor);
+
+    std::lock_guard<std::mutex> guard(cache.mutex);
+    cache.busyDecimators.insert(std::make_pair(decimator, key));
+    return decimator;
+}
+
+void
+KernelCache::releaseDecimator(Decimator *decimator)
+{
+    if (!decimator) return;
+
+    Cache &cache = getCache();
+    std::lock_guard<std::mutex> guard(cache.mutex);
+
+    std::map<Decimator *, DecimatorKey>::iterator i =
+        cache.busyDecimators.find(decimator);
+    if (i == cache.busyDecimators.end()) {
+        delete decimator;
+        return;
+    }
+
+    cache.idleDecimators[i->second].push_back(decimator);
+    cache.busyDecimators.erase(i);
+}
+
+void
+KernelCache::clear()
+{
+    Cache &cache = getCache();
+    std::lock_guard<std::mutex> guard(cache.mutex);
+
+    for (std::map<ChromaKey, std::vector<Chromagram *> >::iterator i =
+             cache.idleChroma.begin(); i != cache.idleChroma.end(); ++i) {
+        for (size_t j = 0; j < i->second.size(); ++j) {
+            delete i->second[j];
+        }
+    }
+    cache.idleChroma.clear();
+
+    for (std::map<DecimatorKey, std::vector<Decimator *> >::iterator i =
+             cache.idleDecimators.begin();
+         i != cache.idleDecimators.end(); ++i) {
+        for (size_t j = 0; j < i->second.size(); ++j) {
+            delete i->second[j];
+        }
+    }
+    cache.idleDecimators.clear();
+
+    // Anything still in use is deleted, rather than kept, on release
+    cache.busyChroma.clear();
+    cache.busyDecimators.clear();
+}
+
+}
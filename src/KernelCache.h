@@ -0,0 +1,61 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_KERNEL_CACHE_H
+#define KEY_DETECTOR_KERNEL_CACHE_H
+
+struct ChromaConfig;
+class Chromagram;
+class Decimator;
+
+namespace KD {
+
+/**
+ * Process-wide store of idle Chromagram and Decimator objects, from
+ * which front ends take theirs and to which they return them.
+ *
+ * Building a Chromagram means building its constant-Q kernel, which
+ * is by far the most expensive part of constructing a detector. The
+ * qm-dsp objects keep their working buffers alongside their kernels
+ * and filter coefficients, so they can't be used by more than one
+ * detector at a time; instead, objects are handed back here when a
+ * detector is finished with them and passed on to the next detector
+ * that asks for one with the same configuration.
+ *
+ * All functions are thread-safe.
+ */
+class KernelCache
+{
+public:
+    /**
+     * Return a Chromagram for the given configuration, reusing an
+     * idle one if available. Return it with releaseChromagram() when
+     * done.
+     */
+    static Chromagram *acquireChromagram(const ChromaConfig &config);
+    static void releaseChromagram(Chromagram *chroma);
+
+    /**
+     * Return a Decimator for the given input length and factor, with
+     * its filter state reset, reusing an idle one if available.
+     * Return it with releaseDecimator() when done.
+     */
+    static Decimator *acquireDecimator(int inLength, int factor);
+    static void releaseDecimator(Decimator *decimator);
+
+    /**
+     * Delete all idle objects. Objects currently in use are
+     * unaffected, and are deleted rather than kept when released.
+     */
+    static void clear();
+};
+
+}
+
+#endif
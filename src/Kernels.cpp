@@ -0,0 +1,275 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "Kernels.h"
+#include "KernelsImpl.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace KD {
+
+static void
+weightedRowSumScalar(const double *matrix, const double *weights,
+                     int rows, int columns, double *out)
+{
+    for (int c = 0; c < columns; ++c) {
+        out[c] = 0.0;
+    }
+    for (int r = 0; r < rows; ++r) {
+        const double w = weights[r];
+        const double *row = matrix + r * columns;
+        for (int c = 0; c < columns; ++c) {
+            out[c] += w * row[c];
+        }
+    }
+}
+
+static void
+weightedRowSumsScalar(const double *matrix, const double *weights,
+                      int count, int rows, int columns, double *out)
+{
+    for (int i = 0; i < count; ++i) {
+        weightedRowSumScalar(matrix, weights + i * rows,
+                             rows, columns, out + i * columns);
+    }
+}
+
+static void
+floatToDoubleScalar(const float *in, double *out, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        out[i] = in[i];
+    }
+}
+
+const KernelTable scalarKernels = {
+    KeyDetector::INSTRUCTIONS_SCALAR, "scalar",
+    weightedRowSumScalar,
+    weightedRowSumsScalar,
+    floatToDoubleScalar
+};
+
+#ifdef __SSE2__
+
+static void
+weightedRowSumSSE2(const double *matrix, const double *weights,
+                   int rows, int columns, double *out)
+{
+    int c = 0;
+    for (; c + 2 <= columns; c += 2) {
+        __m128d acc = _mm_setzero_pd();
+        for (int r = 0; r < rows; ++r) {
+            __m128d w = _mm_set1_pd(weights[r]);
+            __m128d m = _mm_loadu_pd(matrix + r * columns + c);
+            acc = _mm_add_pd(acc, _mm_mul_pd(w, m));
+        }
+        _mm_storeu_pd(out + c, acc);
+    }
+    for (; c < columns; ++c) {
+        double acc = 0.0;
+        for (int r = 0; r < rows; ++r) {
+            acc += weights[r] * matrix[r * columns + c];
+        }
+        out[c] = acc;
+    }
+}
+
+static void
+weightedRowSumsSSE2(const double *matrix, const double *weights,
+                    int count, int rows, int columns, double *out)
+{
+    // Two weight vectors at a time, sharing each load from the matrix
+    int i = 0;
+    for (; i + 2 <= count && columns >= 2; i += 2) {
+        const double *w0 = weights + i * rows;
+        const double *w1 = w0 + rows;
+        double *out0 = out + i * columns;
+        double *out1 = out0 + columns;
+        int c = 0;
+        for (; c + 2 <= columns; c += 2) {
+            __m128d acc0 = _mm_setzero_pd();
+            __m128d acc1 = _mm_setzero_pd();
+            for (int r = 0; r < rows; ++r) {
+                __m128d m = _mm_loadu_pd(matrix + r * columns + c);
+                acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_set1_pd(w0[r]), m));
+                acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_set1_pd(w1[r]), m));
+            }
+            _mm_storeu_pd(out0 + c, acc0);
+            _mm_storeu_pd(out1 + c, acc1);
+        }
+        for (; c < columns; ++c) {
+            double acc0 = 0.0, acc1 = 0.0;
+            for (int r = 0; r < rows; ++r) {
+                acc0 += w0[r] * matrix[r * columns + c];
+                acc1 += w1[r] * matrix[r * columns + c];
+            }
+            out0[c] = acc0;
+            out1[c] = acc1;
+        }
+    }
+    for (; i < count; ++i) {
+        weightedRowSumSSE2(matrix, weights + i * rows,
+                           rows, columns, out + i * columns);
+    }
+}
+
+static void
+floatToDoubleSSE2(const float *in, double *out, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 f = _mm_loadu_ps(in + i);
+        _mm_storeu_pd(out + i, _mm_cvtps_pd(f));
+        _mm_storeu_pd(out + i + 2, _mm_cvtps_pd(_mm_movehl_ps(f, f)));
+    }
+    for (; i < count; ++i) {
+        out[i] = in[i];
+    }
+}
+
+const KernelTable sse2Kernels = {
+    KeyDetector::INSTRUCTIONS_SSE2, "sse2",
+    weightedRowSumSSE2,
+    weightedRowSumsSSE2,
+    floatToDoubleSSE2
+};
+
+#else
+
+// Not available: same as scalar, but never selected
+const KernelTable sse2Kernels = {
+    KeyDetector::INSTRUCTIONS_SSE2, "sse2",
+    weightedRowSumScalar,
+    weightedRowSumsScalar,
+    floatToDoubleScalar
+};
+
+#endif
+
+static bool
+haveSSE2()
+{
+#if defined(__SSE2__) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("sse2");
+#else
+    return false;
+#endif
+}
+
+static bool
+haveAVX2()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return avx2Kernels && __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+static const KernelTable *
+getTable(KeyDetector::InstructionSet set)
+{
+    switch (set) {
+    case KeyDetector::INSTRUCTIONS_AUTO:
+        if (haveAVX2()) return avx2Kernels;
+        if (haveSSE2()) return &sse2Kernels;
+        return &scalarKernels;
+    case KeyDetector::INSTRUCTIONS_SCALAR:
+        return &scalarKernels;
+    case KeyDetector::INSTRUCTIONS_SSE2:
+        return haveSSE2() ? &sse2Kernels : 0;
+    case KeyDetector::INSTRUCTIONS_AVX2:
+        return haveAVX2() ? avx2Kernels : 0;
+    }
+    return 0;
+}
+
+// Scalar until the selection below has run, in case anything is
+// called during static initialisation
+static std::atomic<const KernelTable *> current(&scalarKernels);
+
+static bool
+selectInitialTable()
+{
+    KeyDetector::InstructionSet set = KeyDetector::INSTRUCTIONS_AUTO;
+
+    const char *env = getenv("KEYDETECTOR_INSTRUCTIONS");
+    if (env) {
+        if (!strcmp(env, "scalar")) set = KeyDetector::INSTRUCTIONS_SCALAR;
+        else if (!strcmp(env, "sse2")) set = KeyDetector::INSTRUCTIONS_SSE2;
+        else if (!strcmp(env, "avx2")) set = KeyDetector::INSTRUCTIONS_AVX2;
+    }
+
+    if (!Kernels::setInstructionSet(set)) {
+        Kernels::setInstructionSet(KeyDetector::INSTRUCTIONS_AUTO);
+    }
+    return true;
+}
+
+static bool selected = selectInitialTable();
+
+void
+Kernels::weightedRowSum(const double *matrix, const double *weights,
+                        int rows, int columns, double *out)
+{
+    current.load(std::memory_order_relaxed)->weightedRowSum
+        (matrix, weights, rows, columns, out);
+}
+
+void
+Kernels::weightedRowSums(const double *matrix, const double *weights,
+                         int count, int rows, int columns, double *out)
+{
+    current.load(std::memory_order_relaxed)->weightedRowSums
+        (matrix, weights, count, rows, columns, out);
+}
+
+void
+Kernels::floatToDouble(const float *in, double *out, int count)
+{
+    current.load(std::memory_order_relaxed)->floatToDouble(in, out, count);
+}
+
+bool
+Kernels::isSupported(InstructionSet set)
+{
+    return getTable(set) != 0;
+}
+
+bool
+Kernels::setInstructionSet(InstructionSet set)
+{
+    const KernelTable *table = getTable(set);
+    if (!table) {
+        return false;
+    }
+    current.store(table);
+    return true;
+}
+
+Kernels::InstructionSet
+Kernels::getInstructionSet()
+{
+    return current.load()->instructionSet;
+}
+
+const char *
+Kernels::getInstructionSetName()
+{
+    return current.load()->name;
+}
+
+}
@@ -0,0 +1,95 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_KERNELS_H
+#define KEY_DETECTOR_KERNELS_H
+
+#include "keydetector/KeyDetector.h"
+
+namespace KD {
+
+/**
+ * Small numerical kernels used in the per-hop processing, with
+ * scalar, SSE2 and AVX2 implementations held in one dispatch table
+ * per instruction set. The best table the CPU supports is chosen
+ * when the library is loaded, unless the KEYDETECTOR_INSTRUCTIONS
+ * environment variable names another ("scalar", "sse2" or "avx2"),
+ * and it may be changed later with setInstructionSet().
+ *
+ * Every implementation forms each sum in the same order as the
+ * scalar one and does not fuse multiplies with adds, so results are
+ * identical whichever is chosen.
+ */
+class Kernels
+{
+public:
+    /**
+     * Sum the rows of a matrix, each weighted by the corresponding
+     * element of weights. The matrix has the given number of rows,
+     * each of length columns, stored contiguously. That is,
+     *
+     *   out[c] = sum over r of weights[r] * matrix[r * columns + c]
+     *
+     * accumulated in order of increasing r.
+     */
+    static void weightedRowSum(const double *matrix,
+                               const double *weights,
+                               int rows, int columns,
+                               double *out);
+
+    /**
+     * Carry out weightedRowSum() on the same matrix for each of count
+     * weight vectors, stored one after another, writing the results
+     * one after another to out. That is, the product of the count by
+     * rows matrix of weights with the matrix. Each result is exactly
+     * what weightedRowSum() would give, but each row of the matrix is
+     * loaded once for several weight vectors.
+     */
+    static void weightedRowSums(const double *matrix,
+                                const double *weights,
+                                int count, int rows, int columns,
+                                double *out);
+
+    /**
+     * Convert count single-precision values to double.
+     */
+    static void floatToDouble(const float *in, double *out, int count);
+
+    typedef KeyDetector::InstructionSet InstructionSet;
+
+    /**
+     * Return true if the given instruction set is both compiled in
+     * and supported by this CPU. INSTRUCTIONS_AUTO is always
+     * supported.
+     */
+    static bool isSupported(InstructionSet set);
+
+    /**
+     * Switch to the implementations for the given instruction set, or
+     * to the best available for INSTRUCTIONS_AUTO. Return false and
+     * change nothing if the set is not supported.
+     */
+    static bool setInstructionSet(InstructionSet set);
+
+    /**
+     * Return the instruction set whose implementations are in use.
+     * This is never INSTRUCTIONS_AUTO.
+     */
+    static InstructionSet getInstructionSet();
+
+    /**
+     * Return the name of the instruction set in use: "scalar", "sse2"
+     * or "avx2".
+     */
+    static const char *getInstructionSetName();
+};
+
+}
+
+#endif
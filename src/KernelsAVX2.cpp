@@ -0,0 +1,124 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+// This file is compiled with AVX2 enabled, and nothing in it may be
+// called unless the CPU has been found to support AVX2.
+
+#include "KernelsImpl.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace KD {
+
+#ifdef __AVX2__
+
+static void
+weightedRowSumAVX2(const double *matrix, const double *weights,
+                   int rows, int columns, double *out)
+{
+    int c = 0;
+    for (; c + 4 <= columns; c += 4) {
+        __m256d acc = _mm256_setzero_pd();
+        for (int r = 0; r < rows; ++r) {
+            __m256d w = _mm256_set1_pd(weights[r]);
+            __m256d m = _mm256_loadu_pd(matrix + r * columns + c);
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(w, m));
+        }
+        _mm256_storeu_pd(out + c, acc);
+    }
+    for (; c < columns; ++c) {
+        double acc = 0.0;
+        for (int r = 0; r < rows; ++r) {
+            acc += weights[r] * matrix[r * columns + c];
+        }
+        out[c] = acc;
+    }
+}
+
+static void
+weightedRowSumsAVX2(const double *matrix, const double *weights,
+                    int count, int rows, int columns, double *out)
+{
+    // Four weight vectors at a time, sharing each load from the matrix
+    int i = 0;
+    for (; i + 4 <= count && columns >= 4; i += 4) {
+        const double *w0 = weights + i * rows;
+        const double *w1 = w0 + rows;
+        const double *w2 = w1 + rows;
+        const double *w3 = w2 + rows;
+        double *out0 = out + i * columns;
+        int c = 0;
+        for (; c + 4 <= columns; c += 4) {
+            __m256d acc0 = _mm256_setzero_pd();
+            __m256d acc1 = _mm256_setzero_pd();
+            __m256d acc2 = _mm256_setzero_pd();
+            __m256d acc3 = _mm256_setzero_pd();
+            for (int r = 0; r < rows; ++r) {
+                __m256d m = _mm256_loadu_pd(matrix + r * columns + c);
+                acc0 = _mm256_add_pd
+                    (acc0, _mm256_mul_pd(_mm256_set1_pd(w0[r]), m));
+                acc1 = _mm256_add_pd
+                    (acc1, _mm256_mul_pd(_mm256_set1_pd(w1[r]), m));
+                acc2 = _mm256_add_pd
+                    (acc2, _mm256_mul_pd(_mm256_set1_pd(w2[r]), m));
+                acc3 = _mm256_add_pd
+                    (acc3, _mm256_mul_pd(_mm256_set1_pd(w3[r]), m));
+            }
+            _mm256_storeu_pd(out0 + c, acc0);
+            _mm256_storeu_pd(out0 + columns + c, acc1);
+            _mm256_storeu_pd(out0 + 2 * columns + c, acc2);
+            _mm256_storeu_pd(out0 + 3 * columns + c, acc3);
+        }
+        for (; c < columns; ++c) {
+            const double *ws[4] = { w0, w1, w2, w3 };
+            for (int j = 0; j < 4; ++j) {
+                double acc = 0.0;
+                for (int r = 0; r < rows; ++r) {
+                    acc += ws[j][r] * matrix[r * columns + c];
+                }
+                out0[j * columns + c] = acc;
+            }
+        }
+    }
+    for (; i < count; ++i) {
+        weightedRowSumAVX2(matrix, weights + i * rows,
+                           rows, columns, out + i * columns);
+    }
+}
+
+static void
+floatToDoubleAVX2(const float *in, double *out, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps(in + i)));
+    }
+    for (; i < count; ++i) {
+        out[i] = in[i];
+    }
+}
+
+static const KernelTable table = {
+    KeyDetector::INSTRUCTIONS_AVX2, "avx2",
+    weightedRowSumAVX2,
+    weightedRowSumsAVX2,
+    floatToDoubleAVX2
+};
+
+const KernelTable *const avx2Kernels = &table;
+
+#else
+
+const KernelTable *const avx2Kernels = 0;
+
+#endif
+
+}
@@ -0,0 +1,46 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_KERNELS_IMPL_H
+#define KEY_DETECTOR_KERNELS_IMPL_H
+
+#include "Kernels.h"
+
+namespace KD {
+
+/**
+ * One implementation of each function in Kernels, all for the same
+ * instruction set.
+ */
+struct KernelTable
+{
+    KeyDetector::InstructionSet instructionSet;
+    const char *name;
+
+    void (*weightedRowSum)(const double *matrix, const double *weights,
+                           int rows, int columns, double *out);
+
+    void (*weightedRowSums)(const double *matrix, const double *weights,
+                            int count, int rows, int columns, double *out);
+
+    void (*floatToDouble)(const float *in, double *out, int count);
+};
+
+// The scalar and SSE2 tables are in Kernels.cpp. The AVX2 one is in
+// its own translation unit, compiled with AVX2 enabled, and must only
+// be used if the CPU supports it. It is 0 if the library was built
+// without AVX2.
+
+extern const KernelTable scalarKernels;
+extern const KernelTable sse2Kernels;
+extern const KernelTable *const avx2Kernels;
+
+}
+
+#endif
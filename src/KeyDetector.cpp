@@ -8,35 +8,92 @@
 */
 
 #include "keydetector/KeyDetector.h"
+#include "keydetector/ChromaFile.h"
 
 #include "KeyDetectorQM.h"
 #include "KeyDetectorDaschuer.h"
+#include "ChromaFrontEnd.h"
+#include "FrameRing.h"
+#include "KernelCache.h"
+#include "Kernels.h"
 
 #include <stdexcept>
+#include <thread>
 
 namespace KD {
 
-KeyDetector::KeyDetector(Config config) :
-    m_kdi(0)
+// Translate the channel mode into the mixing parameters of a backend
+// configuration
+template <typename BackendConfig>
+static void
+setChannelLayout(KeyDetector::Config config, BackendConfig &bconfig)
+{
+    if (config.channels < 1) {
+        throw std::logic_error("config.channels must be at least 1");
+    }
+
+    bconfig.channels = config.channels;
+
+    switch (config.channelMode) {
+
+    case KeyDetector::CHANNELS_MEAN:
+        bconfig.mixFirst = 0;
+        bconfig.mixCount = config.channels;
+        break;
+
+    case KeyDetector::CHANNELS_MID:
+        bconfig.mixFirst = 0;
+        bconfig.mixCount = (config.channels < 2 ? config.channels : 2);
+        break;
+
+    case KeyDetector::CHANNELS_SELECT:
+        if (config.selectedChannel < 0 ||
+            config.selectedChannel >= config.channels) {
+            throw std::logic_error("config.selectedChannel out of range");
+        }
+        bconfig.mixFirst = config.selectedChannel;
+        bconfig.mixCount = 1;
+        break;
+
+    case KeyDetector::CHANNELS_SEPARATE:
+        // Audio goes through a front end of our own, created from
+        // the first backend, and the backends are given chroma
+        bconfig.mixFirst = 0;
+        bconfig.mixCount = 0;
+        bconfig.chromaInput = true;
+        break;
+
+    default:
+        throw std::logic_error("unknown config.channelMode");
+    }
+}
+
+static KeyDetectorIface *
+createBackend(KeyDetector::Config config)
 {
     switch (config.method) {
 
-    case METHOD_QM: {
+    case KeyDetector::METHOD_QM: {
         KeyDetectorQM::Config qconfig(config.sampleRate);
         qconfig.tuningFrequency = config.tuningFrequency;
         qconfig.hpcpAverageWindowLength = config.smoothingWindowLength;
         qconfig.medianAverageWindowLength = config.smoothingWindowLength;
-        m_kdi = new KeyDetectorQM(qconfig);
-        break;
+        qconfig.precision = config.precision;
+        qconfig.allocator = config.allocator;
+        qconfig.chromaInput = config.chromaInput;
+        setChannelLayout(config, qconfig);
+        return new KeyDetectorQM(qconfig);
     }
 
-    case METHOD_DASCHUER: {
+    case KeyDetector::METHOD_DASCHUER: {
         KeyDetectorDaschuer::Config dconfig(config.sampleRate);
         dconfig.tuningFrequency = config.tuningFrequency;
         dconfig.hpcpAverageWindowLength = config.smoothingWindowLength;
         dconfig.medianAverageWindowLength = config.smoothingWindowLength;
-        m_kdi = new KeyDetectorDaschuer(dconfig);
-        break;
+        dconfig.allocator = config.allocator;
+        dconfig.chromaInput = config.chromaInput;
+        setChannelLayout(config, dconfig);
+        return new KeyDetectorDaschuer(dconfig);
     }
 
     default:
@@ -44,14 +101,496 @@ KeyDetector::KeyDetector(Config config) :
     }
 }
 
+KeyDetector::KeyDetector(Config config) :
+    m_config(config),
+    m_kdi(0),
+    m_ring(0),
+    m_streamFrame(0),
+    m_streamKey(-1),
+    m_stableKey(0),
+    m_stableHops(0),
+    m_confidence(0.0),
+    m_channelFrontEnd(0)
+{
+    m_kdi = createBackend(config);
+
+    // The destructor is not called if the constructor throws
+    try {
+        createChannels();
+    } catch (...) {
+        delete m_kdi;
+        throw;
+    }
+}
+
 KeyDetector::~KeyDetector()
 {
+    deleteChannels();
+    delete m_ring;
     delete m_kdi;
 }
 
-int KeyDetector::process(double *pcmData)
+void
+KeyDetector::createChannels()
+{
+    int channels = m_config.channels;
+
+    // Leave no channels at all, rather than some, if anything fails.
+    // The pointer arrays are resized last so that they are never
+    // left smaller than before
+    try {
+        if (m_config.channelMode == CHANNELS_SEPARATE) {
+            m_channelKdis.reserve(channels - 1);
+            m_channelFrontEnd = m_kdi->createFrontEnd();
+            for (int c = 1; c < channels; ++c) {
+                m_channelKdis.push_back(createBackend(m_config));
+            }
+        }
+        m_doubleChannels.resize(channels, 0);
+        m_floatChannels.resize(channels, 0);
+        m_channelKeys.resize(channels, 0);
+    } catch (...) {
+        deleteChannels();
+        throw;
+    }
+}
+
+void
+KeyDetector::deleteChannels()
+{
+    for (size_t i = 0; i < m_channelKdis.size(); ++i) {
+        delete m_channelKdis[i];
+    }
+    m_channelKdis.clear();
+
+    delete m_channelFrontEnd;
+    m_channelFrontEnd = 0;
+}
+
+int KeyDetector::process(const double *pcmData)
+{
+    return updateConvergence(m_kdi->process(pcmData));
+}
+
+int KeyDetector::process(const float *pcmData)
+{
+    return updateConvergence(m_kdi->process(pcmData));
+}
+
+int
+KeyDetector::processInterleaved(const double *frame)
+{
+    for (int c = 0; c < m_config.channels; ++c) {
+        m_doubleChannels[c] = frame + c;
+    }
+    return processChannels(m_doubleChannels.data(), m_config.channels);
+}
+
+int
+KeyDetector::processInterleaved(const float *frame)
+{
+    for (int c = 0; c < m_config.channels; ++c) {
+        m_floatChannels[c] = frame + c;
+    }
+    return processChannels(m_floatChannels.data(), m_config.channels);
+}
+
+int
+KeyDetector::processPlanar(const double *const *frames)
 {
-    return m_kdi->process(pcmData);
+    return processChannels(frames, 1);
+}
+
+int
+KeyDetector::processPlanar(const float *const *frames)
+{
+    return processChannels(frames, 1);
+}
+
+template <typename T>
+int
+KeyDetector::processChannels(const T *const *channels, int stride)
+{
+    if (!m_channelFrontEnd) {
+        return updateConvergence(m_kdi->process(channels, stride));
+    }
+
+    // Each channel's chroma must be used before the next is
+    // calculated, as they share the chromagram's output buffer
+    for (int c = 0; c < m_config.channels; ++c) {
+        KeyDetectorIface *kdi = (c == 0 ? m_kdi : m_channelKdis[c - 1]);
+        m_channelKeys[c] = kdi->processChroma
+            (m_channelFrontEnd->processChannel(channels, stride, c));
+    }
+
+    return updateConvergence(m_channelKeys[0]);
+}
+
+int
+KeyDetector::getChannelKey(int channel) const
+{
+    if (channel < 0 || channel >= int(m_channelKeys.size())) {
+        return 0;
+    }
+    return m_channelKeys[channel];
+}
+
+void
+KeyDetector::getChannelKeyStrengths(int channel, double *strengths) const
+{
+    if (channel <= 0 || channel > int(m_channelKdis.size())) {
+        m_kdi->getKeyStrengths(strengths);
+    } else {
+        m_channelKdis[channel - 1]->getKeyStrengths(strengths);
+    }
+}
+
+int
+KeyDetector::updateConvergence(int key)
+{
+    m_confidence = m_kdi->getMargin(key);
+
+    if (key == 0 || key != m_stableKey ||
+        m_confidence < m_config.convergenceConfidence) {
+        m_stableKey = key;
+        m_stableHops = 0;
+    }
+
+    if (key != 0 && m_confidence >= m_config.convergenceConfidence) {
+        ++m_stableHops;
+    }
+
+    return key;
+}
+
+bool
+KeyDetector::hasConverged() const
+{
+    double hops = m_config.convergenceTime * m_config.sampleRate /
+        getHopSize();
+    return m_stableHops > 0 && m_stableHops >= hops;
+}
+
+double
+KeyDetector::getConfidence() const
+{
+    return m_confidence;
+}
+
+KeyDetector::Analysis
+KeyDetector::analyseBuffer(const double *buffer, size_t length)
+{
+    Analysis analysis;
+    m_kdi->analyse(buffer, length, analysis.keys, analysis.keyStrengths);
+    summarise(analysis);
+    return analysis;
+}
+
+KeyDetector::Analysis
+KeyDetector::analyseBuffer(const float *buffer, size_t length)
+{
+    Analysis analysis;
+    m_kdi->analyse(buffer, length, analysis.keys, analysis.keyStrengths);
+    summarise(analysis);
+    return analysis;
+}
+
+int
+KeyDetector::processChroma(const double *chroma)
+{
+    double normalised[ChromaFile::BinsPerOctave];
+    for (int i = 0; i < ChromaFile::BinsPerOctave; ++i) {
+        normalised[i] = chroma[i];
+    }
+    m_kdi->normaliseChroma(normalised);
+    return updateConvergence(m_kdi->processChroma(normalised));
+}
+
+void
+KeyDetector::accumulateChroma(const double *chroma)
+{
+    double normalised[ChromaFile::BinsPerOctave];
+    for (int i = 0; i < ChromaFile::BinsPerOctave; ++i) {
+        normalised[i] = chroma[i];
+    }
+    m_kdi->normaliseChroma(normalised);
+    m_kdi->accumulateChroma(normalised);
+}
+
+KeyDetector::Analysis
+KeyDetector::analyseChroma(const ChromaFile &file)
+{
+    if (!file.isOpen()) {
+        throw std::logic_error("chroma file is not open");
+    }
+    if (file.getSampleRate() != m_config.sampleRate ||
+        file.getTuningFrequency() != m_config.tuningFrequency) {
+        throw std::logic_error
+            ("chroma file sample rate or tuning frequency differs from "
+             "configuration");
+    }
+
+    return analyseChroma(file.getFrames());
+}
+
+KeyDetector::Analysis
+KeyDetector::analyseChroma(const ChromaFrames &chromaFrames)
+{
+    Analysis analysis;
+    size_t frames = chromaFrames.getFrameCount();
+    analysis.keys.resize(frames);
+    analysis.keyStrengths.resize(frames * 24);
+
+    double chroma[ChromaFile::BinsPerOctave];
+
+    for (size_t i = 0; i < frames; ++i) {
+        chromaFrames.readFrame(i, chroma);
+        m_kdi->normaliseChroma(chroma);
+        analysis.keys[i] = m_kdi->processChroma(chroma);
+        m_kdi->getKeyStrengths(analysis.keyStrengths.data() + i * 24);
+    }
+
+    summarise(analysis);
+    return analysis;
+}
+
+void
+KeyDetector::accumulate(const double *frame)
+{
+    m_kdi->accumulate(frame);
+}
+
+void
+KeyDetector::accumulate(const float *frame)
+{
+    m_kdi->accumulate(frame);
+}
+
+void
+KeyDetector::accumulateBuffer(const double *buffer, size_t length)
+{
+    m_kdi->accumulateBuffer(buffer, length);
+}
+
+void
+KeyDetector::accumulateBuffer(const float *buffer, size_t length)
+{
+    m_kdi->accumulateBuffer(buffer, length);
+}
+
+KeyDetector::GlobalKey
+KeyDetector::finish()
+{
+    GlobalKey result;
+    result.key = m_kdi->finish(result.confidence);
+    return result;
+}
+
+static int
+getThreadCount(int threads)
+{
+    if (threads <= 0) {
+        threads = int(std::thread::hardware_concurrency());
+    }
+    return threads > 0 ? threads : 1;
+}
+
+KeyDetector::Analysis
+KeyDetector::analyseBufferParallel(const double *buffer, size_t length,
+                                   int threads)
+{
+    Analysis analysis;
+    m_kdi->analyseParallel(buffer, length, getThreadCount(threads),
+                           analysis.keys, analysis.keyStrengths);
+    summarise(analysis);
+    return analysis;
+}
+
+KeyDetector::Analysis
+KeyDetector::analyseBufferParallel(const float *buffer, size_t length,
+                                   int threads)
+{
+    Analysis analysis;
+    m_kdi->analyseParallel(buffer, length, getThreadCount(threads),
+                           analysis.keys, analysis.keyStrengths);
+    summarise(analysis);
+    return analysis;
+}
+
+void
+KeyDetector::summarise(Analysis &analysis) const
+{
+    int counts[25] = { 0 };
+    for (size_t i = 0; i < analysis.keys.size(); ++i) {
+        int key = analysis.keys[i];
+        if (key > 0 && key <= 24) {
+            ++counts[key];
+        }
+    }
+
+    for (int key = 1; key <= 24; ++key) {
+        if (counts[key] > counts[analysis.globalKey]) {
+            analysis.globalKey = key;
+        }
+    }
+}
+
+void
+KeyDetector::reset()
+{
+    m_kdi->reset();
+
+    if (m_ring) {
+        m_ring->reset();
+    }
+    m_streamFrame = 0;
+    m_streamKey = -1;
+    m_keyChanges.clear();
+
+    m_stableKey = 0;
+    m_stableHops = 0;
+    m_confidence = 0.0;
+
+    if (m_channelFrontEnd) {
+        m_channelFrontEnd->reset();
+    }
+    for (size_t i = 0; i < m_channelKdis.size(); ++i) {
+        m_channelKdis[i]->reset();
+    }
+    for (size_t i = 0; i < m_channelKeys.size(); ++i) {
+        m_channelKeys[i] = 0;
+    }
+}
+
+void
+KeyDetector::reconfigure(Config config)
+{
+    if (config.method != m_config.method ||
+        config.sampleRate != m_config.sampleRate ||
+        config.tuningFrequency != m_config.tuningFrequency ||
+        config.precision != m_config.precision ||
+        config.allocator != m_config.allocator ||
+        config.channels != m_config.channels ||
+        config.channelMode != m_config.channelMode ||
+        config.selectedChannel != m_config.selectedChannel ||
+        config.chromaInput != m_config.chromaInput) {
+
+        // The front end or the backend's storage changes, so we
+        // need a new backend. Its decimator and chromagram come from
+        // the kernel cache if this configuration has been seen before
+        // If the new channels can't be created, go back to the old
+        // backend and channels, so that the detector is unchanged
+        KeyDetectorIface *kdi = createBackend(config);
+        KeyDetectorIface *oldKdi = m_kdi;
+        ChromaFrontEnd *oldChannelFrontEnd = m_channelFrontEnd;
+        std::vector<KeyDetectorIface *> oldChannelKdis;
+        oldChannelKdis.swap(m_channelKdis);
+        Config oldConfig = m_config;
+
+        m_kdi = kdi;
+        m_channelFrontEnd = 0;
+        m_config = config;
+
+        try {
+            createChannels();
+        } catch (...) {
+            delete m_kdi;
+            m_kdi = oldKdi;
+            m_channelFrontEnd = oldChannelFrontEnd;
+            m_channelKdis.swap(oldChannelKdis);
+            m_config = oldConfig;
+            throw;
+        }
+
+        for (size_t i = 0; i < oldChannelKdis.size(); ++i) {
+            delete oldChannelKdis[i];
+        }
+        delete oldChannelFrontEnd;
+
+        int blockSize, hopSize;
+        getBlockAndHopSize(oldConfig, blockSize, hopSize);
+        delete oldKdi;
+        if (blockSize != getBlockSize() || hopSize != getHopSize()) {
+            delete m_ring;
+            m_ring = 0;
+        }
+
+        reset();
+        return;
+    }
+
+    if (config.smoothingWindowLength != m_config.smoothingWindowLength) {
+
+        // A backend that fails to resize is left unchanged. Any that
+        // have already been resized are put back to the old lengths,
+        // which fit in the memory they already have and so cannot
+        // fail, leaving the detector with its old configuration
+        int length = config.smoothingWindowLength;
+        int oldLength = m_config.smoothingWindowLength;
+        size_t resized = 0;
+
+        try {
+            m_kdi->setWindowLengths(length, length);
+            ++resized;
+            for (size_t i = 0; i < m_channelKdis.size(); ++i) {
+                m_channelKdis[i]->setWindowLengths(length, length);
+                ++resized;
+            }
+        } catch (...) {
+            if (resized > 0) {
+                m_kdi->setWindowLengths(oldLength, oldLength);
+            }
+            for (size_t i = 0; i + 1 < resized; ++i) {
+                m_channelKdis[i]->setWindowLengths(oldLength, oldLength);
+            }
+            throw;
+        }
+    }
+
+    m_config = config;
+    reset();
+}
+
+int
+KeyDetector::push(const float *samples, size_t count)
+{
+    if (!m_ring) {
+        m_ring = new FrameRing(getBlockSize(), getHopSize());
+    }
+
+    const size_t hopSize = getHopSize();
+    int changes = 0;
+
+    while (count > 0) {
+
+        size_t written = m_ring->write(samples, count);
+        samples += written;
+        count -= written;
+
+        while (m_ring->haveBlock()) {
+            int key = updateConvergence(m_kdi->process(m_ring->getBlock()));
+            if (key != m_streamKey) {
+                m_keyChanges.push_back(KeyChange(m_streamFrame, key));
+                m_streamKey = key;
+                ++changes;
+            }
+            m_ring->advance();
+            m_streamFrame += hopSize;
+        }
+    }
+
+    return changes;
+}
+
+bool
+KeyDetector::getKeyChange(KeyChange &change)
+{
+    if (m_keyChanges.empty()) {
+        return false;
+    }
+    change = m_keyChanges.front();
+    m_keyChanges.pop_front();
+    return true;
 }
 
 int
@@ -72,4 +611,53 @@ KeyDetector::getKeyStrengths() const
     return m_kdi->getKeyStrengths();
 }
 
+void
+KeyDetector::getKeyStrengths(double *strengths) const
+{
+    m_kdi->getKeyStrengths(strengths);
+}
+
+void
+KeyDetector::getBlockAndHopSize(Config config, int &blockSize, int &hopSize)
+{
+    // Both methods use the same front end sizes
+    ChromaFrontEnd::Config fconfig(config.sampleRate);
+    fconfig.tuningFrequency = config.tuningFrequency;
+    ChromaFrontEnd::getSizes(fconfig, blockSize, hopSize);
+}
+
+size_t
+KeyDetector::getWorkingMemorySize() const
+{
+    size_t size = m_kdi->getWorkingMemorySize();
+    for (size_t i = 0; i < m_channelKdis.size(); ++i) {
+        size += m_channelKdis[i]->getWorkingMemorySize();
+    }
+    if (m_channelFrontEnd) {
+        size += m_channelFrontEnd->getMemorySize();
+    }
+    if (m_ring) {
+        size += m_ring->getMemorySize();
+    }
+    return size;
+}
+
+void
+KeyDetector::releaseCachedKernels()
+{
+    KernelCache::clear();
+}
+
+bool
+KeyDetector::setInstructionSet(InstructionSet set)
+{
+    return Kernels::setInstructionSet(set);
+}
+
+KeyDetector::InstructionSet
+KeyDetector::getInstructionSet()
+{
+    return Kernels::getInstructionSet();
+}
+
 }
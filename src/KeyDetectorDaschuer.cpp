@@ -11,11 +11,10 @@
 */
 
 #include "KeyDetectorDaschuer.h"
+#include "ChromaFrontEnd.h"
+#include "Kernels.h"
 
 #include "maths/MathUtilities.h"
-#include "base/Pitch.h"
-#include "dsp/rateconversion/Decimator.h"
-#include "dsp/chromagram/Chromagram.h"
 
 #include <iostream>
 
@@ -92,80 +91,176 @@ static const double MinorMelodicScale[12] =
 static const double MinorGypsyScale[12] =
 { 0.0, -1.0,  0.0,  0.0, -1.0, -1.0,  0.0,  0.0,  0.0, -1.0, -1.0,  0.0};
 
+// Column offsets of each group of 12 rotations in m_templates
+enum {
+    MinorScaleColumn = 0,
+    MinorMelodicScaleColumn = 12,
+    MinorHarmonicScaleColumn = 24,
+    MinorGypsyScaleColumn = 36,
+    MajorChordColumn = 48,
+    MinorChordColumn = 60,
+    TemplateColumns = 72
+};
+
+
+namespace {
+
+struct TemplateTable
+{
+    double templates[12 * TemplateColumns];
+
+    TemplateTable();
+};
+
+TemplateTable::TemplateTable()
+{
+    for (int i = 0; i < 12; i++) {
+        double *row = templates + i * TemplateColumns;
+        for (int k = 0; k < 12; k++) {
+            // The scales are scored relative to the relative major
+            int j = (i - k + 12 + 3) % 12;
+            row[MinorScaleColumn + k] = MinorScale[j];
+            row[MinorMelodicScaleColumn + k] = MinorMelodicScale[j];
+            row[MinorHarmonicScaleColumn + k] = MinorHarmonicScale[j];
+            row[MinorGypsyScaleColumn + k] = MinorGypsyScale[j];
+
+            j = (i - k + 12) % 12;
+            row[MajorChordColumn + k] = MajorChord[j];
+            row[MinorChordColumn + k] = MinorChord[j];
+        }
+    }
+}
+
+const double *
+getTemplates()
+{
+    static const TemplateTable table;
+    return table.templates;
+}
+
+}
 
 KeyDetectorDaschuer::KeyDetectorDaschuer(Config config) :
     m_hpcpAverage(config.hpcpAverageWindowLength),
     m_medianAverage(config.medianAverageWindowLength),
+    m_frontEnd(0),
     m_chrPointer(0),
-    m_decimatedBuffer(0),
+    m_chromaBufferSize(0),
+    m_arena(config.allocator),
     m_chromaBuffer(0),
     m_meanHPCP(0),
     m_inTuneChroma(0),
     m_maxTuneSum(0),
     m_majCorr(0),
     m_minCorr(0),
-    m_medianFilterBuffer(0),
-    m_sortedBuffer(0)
+    m_templates(getTemplates()),
+    m_templateScores(0)
 {
-    m_decimationFactor = 8;
-        
-    // Chromagram configuration parameters
-    ChromaConfig cconfig;
-    cconfig.normalise = MathUtilities::NormaliseNone;
-    cconfig.FS = config.sampleRate / (double)m_decimationFactor;
-    if (cconfig.FS < 1) {
-        cconfig.FS = 1;
+    ChromaFrontEnd::Config fconfig(config.sampleRate);
+    fconfig.tuningFrequency = config.tuningFrequency;
+    fconfig.normalise = MathUtilities::NormaliseNone;
+    fconfig.allocator = config.allocator;
+    fconfig.channels = config.channels;
+    fconfig.mixFirst = config.mixFirst;
+    fconfig.mixCount = config.mixCount;
+    fconfig.chromaInput = config.chromaInput;
+
+    // The front end's buffers go in our arena
+    m_frontEnd = new ChromaFrontEnd(fconfig, true);
+
+    m_BPO = m_frontEnd->getBinsPerOctave();
+
+    // Get calculated parameters from chroma object
+    m_chromaFrameSize = m_frontEnd->getChromaFrameSize();
+    m_chromaHopSize = m_frontEnd->getChromaHopSize();
+
+    // Allocates buffers and resets. The destructor is not called if
+    // the constructor throws
+    try {
+        setWindowLengths(config.hpcpAverageWindowLength,
+                         config.medianAverageWindowLength);
+    } catch (...) {
+        delete m_frontEnd;
+        throw;
+    }
+}
+
+KeyDetectorDaschuer::~KeyDetectorDaschuer()
+{
+    delete m_frontEnd;
+}
+
+void
+KeyDetectorDaschuer::setWindowLengths(int hpcpAverageWindowLength,
+                                      int medianAverageWindowLength)
+{
+    // Chromagram average length. This detector applies no median
+    // filter to its key estimates, so the median length is unused.
+    int chromaBufferSize = 1; // (int)ceil( m_hpcpAverage * fs/m_ChromaFrameSize );
+
+    if (chromaBufferSize != m_chromaBufferSize) {
+        int oldChromaBufferSize = m_chromaBufferSize;
+        m_chromaBufferSize = chromaBufferSize;
+        try {
+            allocateBuffers();
+        } catch (...) {
+            // As for KeyDetectorQM, the old layout needs no allocation
+            m_chromaBufferSize = oldChromaBufferSize;
+            if (oldChromaBufferSize > 0) {
+                allocateBuffers();
+            }
+            throw;
+        }
     }
 
-    // Set C3 (= MIDI #48) as our base:
-    // This implies that key = 1 => Cmaj, key = 12 => Bmaj, key = 13 => Cmin, etc.
-    cconfig.min = Pitch::getFrequencyForPitch(48, 0, config.tuningFrequency);
-    // C7 (= MIDI #96) is the exclusive maximum key:
-    cconfig.max = Pitch::getFrequencyForPitch(96, 0, config.tuningFrequency);
+    m_hpcpAverage = hpcpAverageWindowLength;
+    m_medianAverage = medianAverageWindowLength;
 
-    m_BPO = 36;
-    cconfig.BPO = m_BPO;
-    cconfig.CQThresh = 0.0054;
+    reset();
+}
 
-    // Chromagram inst.
-    m_chroma = new Chromagram(cconfig);
+void
+KeyDetectorDaschuer::allocateBuffers()
+{
+    // Lay out all our buffers, and the front end's, in one block
+    m_arena.clear();
+    m_frontEnd->reserve(m_arena);
+
+    size_t chromaBuffer = m_arena.reserve<double>(m_BPO * m_chromaBufferSize);
+    size_t meanHPCP = m_arena.reserve<double>(m_BPO);
+    size_t inTuneChroma = m_arena.reserve<double>(m_BPO/3);
+    size_t majCorr = m_arena.reserve<double>(m_BPO);
+    size_t minCorr = m_arena.reserve<double>(m_BPO);
+    size_t templateScores = m_arena.reserve<double>(TemplateColumns);
+
+    m_arena.commit();
+    m_frontEnd->attach(m_arena);
+
+    m_chromaBuffer = m_arena.get<double>(chromaBuffer);
+    m_meanHPCP = m_arena.get<double>(meanHPCP);
+    m_inTuneChroma = m_arena.get<double>(inTuneChroma);
+    m_majCorr = m_arena.get<double>(majCorr);
+    m_minCorr = m_arena.get<double>(minCorr);
+    m_templateScores = m_arena.get<double>(templateScores);
+}
 
-    // Get calculated parameters from chroma object
-    m_chromaFrameSize = m_chroma->getFrameSize();
-    m_chromaHopSize = m_chroma->getHopSize();
 
-//    std::cerr << "chroma frame size = " << m_ChromaFrameSize << ", decimation factor = " << m_DecimationFactor << " therefore block size = " << getBlockSize() << std::endl;
+void
+KeyDetectorDaschuer::reset()
+{
+    m_frontEnd->reset();
+    m_chrPointer = 0;
 
-    // Chromagram average and estimated key median filter lengths
-    m_chromaBufferSize = 1; // (int)ceil( m_hpcpAverage * m_ChromaConfig.FS/m_ChromaFrameSize );
-    m_medianWinSize = (int)ceil
-        (m_medianAverage * cconfig.FS / m_chromaFrameSize);
-    
     // Reset counters
     m_bufferIndex = 0;
     m_chromaBufferFilling = 0;
-    m_medianBufferFilling = 0;
-
-    // Spawn objects/arrays
-    m_decimatedBuffer = new double[m_chromaFrameSize];
-    m_chromaBuffer = new double[m_BPO * m_chromaBufferSize];
 
     memset(m_chromaBuffer, 0, sizeof(double) * m_BPO * m_chromaBufferSize);
-    
-    m_meanHPCP = new double[m_BPO];
-    m_inTuneChroma = new double[m_BPO/3];
-    
-    m_majCorr = new double[m_BPO];
-    m_minCorr = new double[m_BPO];
-    
-    m_medianFilterBuffer = new int[ m_medianWinSize ];
-    memset(m_medianFilterBuffer, 0, sizeof(int) * m_medianWinSize);
-    
-    m_sortedBuffer = new int[ m_medianWinSize ];
-    memset(m_sortedBuffer, 0, sizeof(int) * m_medianWinSize);
-    
-    m_decimator = new Decimator
-        (m_chromaFrameSize * m_decimationFactor, m_decimationFactor);
+    memset(m_meanHPCP, 0, sizeof(double) * m_BPO);
+    memset(m_inTuneChroma, 0, sizeof(double) * (m_BPO/3));
+    memset(m_majCorr, 0, sizeof(double) * m_BPO);
+    memset(m_minCorr, 0, sizeof(double) * m_BPO);
+    memset(m_templateScores, 0, sizeof(double) * TemplateColumns);
 
     for (int k = 0; k < 25; k++) {
         m_progressionProbability[k] = 0;
@@ -174,41 +269,101 @@ KeyDetectorDaschuer::KeyDetectorDaschuer(Config config) :
     for (int k = 0; k < 48; k++) {
         m_scaleProbability[k] = 0;
     }
+
+    m_maxTuneSum = 0;
 }
 
-KeyDetectorDaschuer::~KeyDetectorDaschuer()
+int KeyDetectorDaschuer::process(const double *pcmData)
 {
-    delete m_chroma;
-    delete m_decimator;
-    
-    delete [] m_decimatedBuffer;
-    delete [] m_chromaBuffer;
-    delete [] m_meanHPCP;
-    delete [] m_inTuneChroma;
-    delete [] m_majCorr;
-    delete [] m_minCorr;
-    delete [] m_medianFilterBuffer;
-    delete [] m_sortedBuffer;
+    return processChroma(m_frontEnd->process(pcmData));
 }
 
-int KeyDetectorDaschuer::process(double *pcmData)
+int KeyDetectorDaschuer::process(const float *pcmData)
 {
-    int j, k;
+    return processChroma(m_frontEnd->process(pcmData));
+}
 
-    m_decimator->process(pcmData, m_decimatedBuffer);
+int KeyDetectorDaschuer::process(const double *const *channels, int stride)
+{
+    return processChroma(m_frontEnd->process(channels, stride));
+}
 
-    m_chrPointer = m_chroma->process(m_decimatedBuffer);
+int KeyDetectorDaschuer::process(const float *const *channels, int stride)
+{
+    return processChroma(m_frontEnd->process(channels, stride));
+}
 
-    double maxNoteValue;
-    MathUtilities::getMax(m_chrPointer, m_BPO, &maxNoteValue);
+ChromaFrontEnd *
+KeyDetectorDaschuer::createFrontEnd() const
+{
+    ChromaFrontEnd::Config fconfig = m_frontEnd->getConfig();
+    fconfig.chromaInput = false;
+    return new ChromaFrontEnd(fconfig);
+}
+
+void
+KeyDetectorDaschuer::normaliseChroma(double *chroma) const
+{
+    m_frontEnd->normalise(chroma);
+}
+
+int KeyDetectorDaschuer::processChroma(const double *chroma)
+{
+    accumulateChroma(chroma);
+    return decideKey();
+}
+
+void KeyDetectorDaschuer::accumulate(const double *pcmData)
+{
+    accumulateChroma(m_frontEnd->process(pcmData));
+}
+
+void KeyDetectorDaschuer::accumulate(const float *pcmData)
+{
+    accumulateChroma(m_frontEnd->process(pcmData));
+}
+
+int KeyDetectorDaschuer::finish(double &confidence)
+{
+    int key = decideKey();
+    confidence = getMargin(key);
+    return key;
+}
+
+double KeyDetectorDaschuer::getMargin(int key) const
+{
+    if (key < 1 || key > 24) {
+        return 0.0;
+    }
+
+    double runnerUp = 0.0;
+    bool first = true;
+    for (int k = 1; k <= 24; k++) {
+        if (k == key) continue;
+        if (first || m_progressionProbability[k] > runnerUp) {
+            runnerUp = m_progressionProbability[k];
+            first = false;
+        }
+    }
+
+    return getRelativeMargin(m_progressionProbability[key], runnerUp);
+}
+
+void KeyDetectorDaschuer::accumulateChroma(const double *chroma)
+{
+    int j, k;
+
+    m_chrPointer = chroma;
 
     // populate hpcp values;
-    int cbidx;
+    double *hpcp = m_chromaBuffer + m_bufferIndex * m_BPO;
     for (j = 0; j < m_BPO; j++) {
-        cbidx = (m_bufferIndex * m_BPO) + j;
-        m_chromaBuffer[ cbidx ] = m_chrPointer[j];
+        hpcp[j] = m_chrPointer[j];
     }
 
+    double maxNoteValue;
+    MathUtilities::getMax(hpcp, m_BPO, &maxNoteValue);
+
     // keep track of input buffers;
     if (m_bufferIndex++ >= m_chromaBufferSize - 1) {
         m_bufferIndex = 0;
@@ -315,22 +470,17 @@ int KeyDetectorDaschuer::process(double *pcmData)
 #endif
     }
 
+    // Score every rotation of every scale and chord template at once
+    Kernels::weightedRowSum(m_templates, m_inTuneChroma,
+                            12, TemplateColumns, m_templateScores);
+
     const double smooth = 1.0 - 1.0/172.0; // For T of 16 s -> two frames at 120 BPM
 
     for (k = 0; k < 12; k++) {
-        double sumMinor = 0;
-        double sumMinorMelodic = 0;
-        double sumMinorHarmonic = 0;
-        double sumMinorGypsy = 0;
-
-        for (int i = 0; i < 12; i++) {
-            int j = (i - k + 12 + 3) % 12;
-
-            sumMinor += m_inTuneChroma[i] * MinorScale[j];
-            sumMinorMelodic += m_inTuneChroma[i] * MinorMelodicScale[j];
-            sumMinorHarmonic += m_inTuneChroma[i] * MinorHarmonicScale[j];
-            sumMinorGypsy += m_inTuneChroma[i] * MinorGypsyScale[j];
-        }
+        double sumMinor = m_templateScores[MinorScaleColumn + k];
+        double sumMinorMelodic = m_templateScores[MinorMelodicScaleColumn + k];
+        double sumMinorHarmonic = m_templateScores[MinorHarmonicScaleColumn + k];
+        double sumMinorGypsy = m_templateScores[MinorGypsyScaleColumn + k];
 
         m_scaleProbability[k] = m_scaleProbability[k] * smooth + sumMinor * maxTunedValue;
         m_scaleProbability[k+12] = m_scaleProbability[k+12] * smooth + sumMinorMelodic * maxTunedValue;
@@ -347,29 +497,13 @@ int KeyDetectorDaschuer::process(double *pcmData)
         }
     }
 
-    double maxScaleValue;
-    int scale = MathUtilities::getMax(m_scaleProbability, 48, &maxScaleValue) + 1;
-
-    if (maxScaleValue < m_maxTuneSum / 6) {
-        // 6 was adjusted from the undetectable outro of "Green Day" - "Boulevard of Broken Dreams"
-        scale = 0;
-    }
-
     double maxChordValue = 0;
     int maxChord = 0;
 
     for (k = 0; k < 12; k++) {
         
-        m_majCorr[k] = 0;
-        m_minCorr[k] = 0;
-
-        for (int i = 0; i < 12; i++) {
-            
-            int j = (i - k + 12) % 12;
-
-            m_majCorr[k] += m_inTuneChroma[i] * MajorChord[j];
-            m_minCorr[k] += m_inTuneChroma[i] * MinorChord[j];
-        }
+        m_majCorr[k] = m_templateScores[MajorChordColumn + k];
+        m_minCorr[k] = m_templateScores[MinorChordColumn + k];
         
         if (m_majCorr[k] > m_minCorr[k]) {
             if (maxChordValue < m_majCorr[k]) {
@@ -448,6 +582,18 @@ int KeyDetectorDaschuer::process(double *pcmData)
     //std::cout << " " << m_KeyProbability[4] << " " << m_KeyProbability[13];
 
 
+}
+
+int KeyDetectorDaschuer::decideKey()
+{
+    double maxScaleValue;
+    int scale = MathUtilities::getMax(m_scaleProbability, 48, &maxScaleValue) + 1;
+
+    if (maxScaleValue < m_maxTuneSum / 6) {
+        // 6 was adjusted from the undetectable outro of "Green Day" - "Boulevard of Broken Dreams"
+        scale = 0;
+    }
+
     double dummy;
     int progression = MathUtilities::getMax(m_progressionProbability, 25, &dummy);
 
@@ -482,28 +628,31 @@ int KeyDetectorDaschuer::process(double *pcmData)
     }
 
 #ifdef DEBUG_KEY_DETECTOR
-    std::cout << " " << maxChord << " " << progression << " " << scale << " " << key << " "
+    std::cout << " " << progression << " " << scale << " " << key << " "
             << (m_processCall - 1) * m_ChromaHopSize / m_ChromaConfig.FS << std::endl;
 #endif
 
     return key;
 }
 
+size_t
+KeyDetectorDaschuer::getWorkingMemorySize() const
+{
+    return m_arena.getSize();
+}
+
 int
 KeyDetectorDaschuer::getHopSize() const {
-    return m_chromaHopSize * m_decimationFactor;
+    return m_frontEnd->getHopSize();
 }
 
 int
 KeyDetectorDaschuer::getBlockSize() const {
-    return m_chromaFrameSize * m_decimationFactor;
+    return m_frontEnd->getBlockSize();
 }
 
-std::vector<double>
-KeyDetectorDaschuer::getKeyStrengths() const {
-
-    std::vector<double> keyStrengths;
-    keyStrengths.resize(24, 0.0);
+void
+KeyDetectorDaschuer::getKeyStrengths(double *keyStrengths) const {
 
     for (int k = 0; k < m_BPO; k++) {
         int idx = k / (m_BPO/12);
@@ -520,8 +669,6 @@ KeyDetectorDaschuer::getKeyStrengths() const {
             keyStrengths[idx] = m_minCorr[k];
         }
     }
-
-    return keyStrengths;
 }
 
 }
@@ -11,9 +11,7 @@
 #define KEY_DETECTOR_DASCHUER_H
 
 #include "KeyDetectorIface.h"
-
-class Decimator;
-class Chromagram;
+#include "Arena.h"
 
 namespace KD {
 
@@ -25,12 +23,26 @@ public:
         double tuningFrequency;
         int hpcpAverageWindowLength;
         int medianAverageWindowLength;
+        Allocator *allocator;
+
+        // Channel layout of multichannel input and how to mix it
+        // down, and whether only chroma will be supplied; see
+        // ChromaFrontEnd::Config
+        int channels;
+        int mixFirst;
+        int mixCount;
+        bool chromaInput;
 
         Config(double _sampleRate) :
             sampleRate(_sampleRate),
             tuningFrequency(440.0),
             hpcpAverageWindowLength(10),
-            medianAverageWindowLength(10) {
+            medianAverageWindowLength(10),
+            allocator(0),
+            channels(1),
+            mixFirst(0),
+            mixCount(1),
+            chromaInput(false) {
         }
     };
     
@@ -46,46 +58,88 @@ public:
      * Return a key index in the range 0-24, where 0 indicates no key
      * detected, 1 is C major, and 13 is C minor.
      */
-    virtual int process(double *frame);
+    virtual int process(const double *frame);
+
+    /**
+     * Process a single-precision frame. The input is decimated in
+     * single precision and only the decimated signal is converted to
+     * double for the chromagram.
+     */
+    virtual int process(const float *frame);
+
+    virtual int process(const double *const *channels, int stride);
+    virtual int process(const float *const *channels, int stride);
+
+    virtual int processChroma(const double *chroma);
+    virtual void normaliseChroma(double *chroma) const;
+
+    /**
+     * Accumulate for a global key estimate. The statistics are this
+     * detector's smoothed scale and progression probabilities, which
+     * are updated exactly as by process(), but without the per-hop
+     * key decision.
+     */
+    virtual void accumulate(const double *frame);
+    virtual void accumulate(const float *frame);
+    virtual void accumulateChroma(const double *chroma);
+
+    /**
+     * Make the key decision from the current probabilities, with
+     * getMargin() of that key as the confidence.
+     */
+    virtual int finish(double &confidence);
+
+    /**
+     * The margin is the relative difference between the progression
+     * probabilities of the given key and of the best other key.
+     */
+    virtual double getMargin(int key) const;
+
+    virtual ChromaFrontEnd *createFrontEnd() const;
 
     /**
-     * Return a 24-element vector containing the correlation of the
-     * chroma vector generated in the last process() call against the
-     * stored key profiles for the 12 major and 12 minor keys, where
-     * index 0 is C major and 12 is C minor.
+     * Write into keyStrengths the 24 correlations of the chroma
+     * vector generated in the last process() call against the stored
+     * key profiles for the 12 major and 12 minor keys, where index 0
+     * is C major and 12 is C minor.
      */
-    virtual std::vector<double> getKeyStrengths() const;
+    using KeyDetectorIface::getKeyStrengths;
+    virtual void getKeyStrengths(double *keyStrengths) const;
 
     virtual int getHopSize() const;
     virtual int getBlockSize() const;
 
+    virtual size_t getWorkingMemorySize() const;
+
+    virtual void reset();
+    virtual void setWindowLengths(int hpcpAverageWindowLength,
+                                  int medianAverageWindowLength);
+
 protected:
+    void allocateBuffers();
+    int decideKey();
+
     double m_hpcpAverage;
     double m_medianAverage;
 
-    int m_decimationFactor;
-
-    // Decimator (fixed)
-    Decimator *m_decimator;
-
-    // Chromagram object
-    Chromagram *m_chroma;
+    // Decimator and chromagram
+    ChromaFrontEnd *m_frontEnd;
 
     // Chromagram output pointer
-    double *m_chrPointer;
+    const double *m_chrPointer;
 
     int m_chromaFrameSize;
     int m_chromaHopSize;
     int m_BPO;
 
     int m_chromaBufferSize;
-    int m_medianWinSize;
         
     int m_bufferIndex;
     int m_chromaBufferFilling;
-    int m_medianBufferFilling;
 
-    double *m_decimatedBuffer;
+    // Holds all of the buffers below
+    Arena m_arena;
+
     double *m_chromaBuffer;
     double *m_meanHPCP;
     double *m_inTuneChroma;
@@ -95,8 +149,14 @@ protected:
 
     double *m_majCorr;
     double *m_minCorr;
-    int *m_medianFilterBuffer;
-    int *m_sortedBuffer;
+
+    // All 12 rotations of the four minor scale templates and the
+    // major and minor chord templates, one row per chroma note and
+    // one column per template and rotation, and the scores of the
+    // current in-tune chroma against each of them. The templates are
+    // constant and shared by all instances.
+    const double *m_templates;
+    double *m_templateScores;
 };
 
 }
@@ -0,0 +1,266 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "KeyDetectorIface.h"
+#include "ChromaFrontEnd.h"
+
+#include <cmath>
+#include <exception>
+#include <memory>
+#include <thread>
+
+namespace KD {
+
+// Hops processed ahead of each parallel segment to settle the
+// decimator's filter. Every hop passes a whole block through the
+// filter, so this is tens of thousands of samples, far longer than
+// its impulse response takes to decay below double precision; the
+// bench program's --parallel mode compares the result with serial
+// analysis
+static const size_t kWarmupHops = 2;
+
+// Don't bother splitting into segments shorter than this
+static const size_t kMinSegmentHops = 64;
+
+// Return the block of the buffer starting at offset, reading it in
+// place unless it runs off the end of the buffer
+template <typename T>
+static const T *
+getBlock(const T *buffer, size_t length, size_t offset, size_t blockSize,
+         std::vector<T> &padded)
+{
+    if (offset + blockSize <= length) {
+        return buffer + offset;
+    }
+
+    // Only the last few blocks run off the end of the input
+    padded.assign(buffer + offset, buffer + length);
+    padded.resize(blockSize, T(0));
+    return padded.data();
+}
+
+void
+KeyDetectorIface::analyse(const double *buffer, size_t length,
+                          std::vector<int> &keys,
+                          std::vector<double> &keyStrengths)
+{
+    analyseFrames(buffer, length, keys, keyStrengths);
+}
+
+void
+KeyDetectorIface::analyse(const float *buffer, size_t length,
+                          std::vector<int> &keys,
+                          std::vector<double> &keyStrengths)
+{
+    analyseFrames(buffer, length, keys, keyStrengths);
+}
+
+void
+KeyDetectorIface::analyseParallel(const double *buffer, size_t length,
+                                  int threads,
+                                  std::vector<int> &keys,
+                                  std::vector<double> &keyStrengths)
+{
+    analyseSegments(buffer, length, threads, keys, keyStrengths);
+}
+
+void
+KeyDetectorIface::analyseParallel(const float *buffer, size_t length,
+                                  int threads,
+                                  std::vector<int> &keys,
+                                  std::vector<double> &keyStrengths)
+{
+    analyseSegments(buffer, length, threads, keys, keyStrengths);
+}
+
+void
+KeyDetectorIface::accumulateBuffer(const double *buffer, size_t length)
+{
+    accumulateFrames(buffer, length);
+}
+
+void
+KeyDetectorIface::accumulateBuffer(const float *buffer, size_t length)
+{
+    accumulateFrames(buffer, length);
+}
+
+double
+KeyDetectorIface::getRelativeMargin(double best, double runnerUp)
+{
+    double scale = fabs(best) + fabs(runnerUp);
+    if (scale <= 0.0) {
+        return 0.0;
+    }
+    double margin = (best - runnerUp) / scale;
+    return margin < 0.0 ? 0.0 : (margin > 1.0 ? 1.0 : margin);
+}
+
+std::vector<double>
+KeyDetectorIface::getKeyStrengths() const
+{
+    std::vector<double> keyStrengths(24, 0.0);
+    getKeyStrengths(keyStrengths.data());
+    return keyStrengths;
+}
+
+template <typename T>
+void
+KeyDetectorIface::accumulateFrames(const T *buffer, size_t length)
+{
+    const size_t blockSize = getBlockSize();
+    const size_t hopSize = getHopSize();
+
+    std::vector<T> padded;
+
+    for (size_t offset = 0; offset < length; offset += hopSize) {
+        accumulate(getBlock(buffer, length, offset, blockSize, padded));
+    }
+}
+
+template <typename T>
+void
+KeyDetectorIface::analyseFrames(const T *buffer, size_t length,
+                                std::vector<int> &keys,
+                                std::vector<double> &keyStrengths)
+{
+    const size_t blockSize = getBlockSize();
+    const size_t hopSize = getHopSize();
+
+    size_t hops = (length + hopSize - 1) / hopSize;
+    keys.reserve(keys.size() + hops);
+    keyStrengths.reserve(keyStrengths.size() + hops * 24);
+
+    std::vector<T> padded;
+
+    for (size_t offset = 0; offset < length; offset += hopSize) {
+
+        int key = process(getBlock(buffer, length, offset, blockSize, padded));
+
+        keys.push_back(key);
+
+        size_t n = keyStrengths.size();
+        keyStrengths.resize(n + 24);
+        getKeyStrengths(keyStrengths.data() + n);
+    }
+}
+
+template <typename T>
+static void
+calculateChroma(const T *buffer, size_t length,
+                ChromaFrontEnd *frontEnd,
+                size_t startHop, size_t endHop,
+                double *chroma)
+{
+    const size_t blockSize = frontEnd->getBlockSize();
+    const size_t hopSize = frontEnd->getHopSize();
+    const int bins = frontEnd->getBinsPerOctave();
+
+    std::vector<T> padded;
+
+    size_t hop = (startHop > kWarmupHops ? startHop - kWarmupHops : 0);
+
+    for (; hop < endHop; ++hop) {
+        const double *c = frontEnd->process
+            (getBlock(buffer, length, hop * hopSize, blockSize, padded));
+        if (hop >= startHop) {
+            for (int i = 0; i < bins; ++i) {
+                chroma[hop * bins + i] = c[i];
+            }
+        }
+    }
+}
+
+// Run calculateChroma() on a worker thread, keeping any exception
+// for the calling thread to rethrow
+template <typename T>
+static void
+runSegment(const T *buffer, size_t length,
+           ChromaFrontEnd *frontEnd,
+           size_t startHop, size_t endHop,
+           double *chroma, std::exception_ptr *error)
+{
+    try {
+        calculateChroma(buffer, length, frontEnd, startHop, endHop, chroma);
+    } catch (...) {
+        *error = std::current_exception();
+    }
+}
+
+template <typename T>
+void
+KeyDetectorIface::analyseSegments(const T *buffer, size_t length,
+                                  int threads,
+                                  std::vector<int> &keys,
+                                  std::vector<double> &keyStrengths)
+{
+    const size_t hopSize = getHopSize();
+    const size_t hops = (length + hopSize - 1) / hopSize;
+
+    if (threads > 1 && hops / threads < kMinSegmentHops) {
+        threads = int(hops / kMinSegmentHops);
+    }
+    if (threads <= 1) {
+        analyseFrames(buffer, length, keys, keyStrengths);
+        return;
+    }
+
+    std::vector<std::unique_ptr<ChromaFrontEnd> > frontEnds(threads);
+    for (int i = 0; i < threads; ++i) {
+        frontEnds[i].reset(createFrontEnd());
+    }
+
+    const int bins = frontEnds[0]->getBinsPerOctave();
+    std::vector<double> chroma(hops * bins, 0.0);
+
+    // Every thread that was started is joined before anything is
+    // rethrown, whether the failure was in starting a thread, in a
+    // worker or in the calling thread's own segment
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+
+    try {
+        for (int i = 1; i < threads; ++i) {
+            workers.push_back(std::thread
+                              (runSegment<T>, buffer, length,
+                               frontEnds[i].get(),
+                               (hops * i) / threads,
+                               (hops * (i + 1)) / threads,
+                               chroma.data(), &errors[i]));
+        }
+        calculateChroma(buffer, length, frontEnds[0].get(),
+                        0, hops / threads, chroma.data());
+    } catch (...) {
+        errors[0] = std::current_exception();
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    for (int i = 0; i < threads; ++i) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+    }
+
+    // The recursive smoothing and median stages run in sequence
+    keys.reserve(keys.size() + hops);
+    keyStrengths.reserve(keyStrengths.size() + hops * 24);
+
+    for (size_t hop = 0; hop < hops; ++hop) {
+
+        keys.push_back(processChroma(chroma.data() + hop * bins));
+
+        size_t n = keyStrengths.size();
+        keyStrengths.resize(n + 24);
+        getKeyStrengths(keyStrengths.data() + n);
+    }
+}
+
+}
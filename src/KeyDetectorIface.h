@@ -11,9 +11,12 @@
 #define KEY_DETECTOR_IFACE_H
 
 #include <vector>
+#include <cstddef>
 
 namespace KD {
 
+class ChromaFrontEnd;
+
 class KeyDetectorIface
 {
 public:
@@ -27,7 +30,137 @@ public:
      * Return a key index in the range 0-24, where 0 indicates no key
      * detected, 1 is C major, and 13 is C minor.
      */
-    virtual int process(double *frame) = 0;
+    virtual int process(const double *frame) = 0;
+
+    /**
+     * Process a single frame of single-precision input, as for
+     * process(const double *). Implementations should avoid
+     * converting the whole frame to double precision.
+     */
+    virtual int process(const float *frame) = 0;
+
+    /**
+     * Process a multichannel frame, laid out as described for
+     * ChromaFrontEnd::process(const double *const *, int), mixing it
+     * down as configured.
+     */
+    virtual int process(const double *const *channels, int stride) = 0;
+    virtual int process(const float *const *channels, int stride) = 0;
+
+    /**
+     * Carry out the key estimation stages of process() on a chroma
+     * vector already calculated by a front end equivalent to that
+     * returned by createFrontEnd().
+     */
+    virtual int processChroma(const double *chroma) = 0;
+
+    /**
+     * Normalise, in place, a chroma vector calculated without any
+     * normalisation, as the front end returned by createFrontEnd()
+     * would have done before its output reached processChroma().
+     */
+    virtual void normaliseChroma(double *chroma) const = 0;
+
+    /**
+     * Return a new front end with the same configuration as the one
+     * used by process(), with its own independent filter state. The
+     * caller takes ownership. If the detector was configured for
+     * chroma input only, the new front end is a complete one that can
+     * provide that input.
+     */
+    virtual ChromaFrontEnd *createFrontEnd() const = 0;
+
+    /**
+     * Global-key-only analysis. Process a frame as for process(), but
+     * update only the statistics needed for a single key estimate
+     * covering everything accumulated since the last reset(),
+     * skipping the per-hop key decision, median filtering and key
+     * strengths. Call finish() for the estimate.
+     */
+    virtual void accumulate(const double *frame) = 0;
+    virtual void accumulate(const float *frame) = 0;
+
+    /**
+     * Accumulate a chroma vector calculated by a front end equivalent
+     * to that returned by createFrontEnd(), as for accumulate().
+     */
+    virtual void accumulateChroma(const double *chroma) = 0;
+
+    /**
+     * Return the key (0-24, as for process()) estimated from all
+     * frames accumulated since the last reset(), and set confidence
+     * to a value between 0 and 1 indicating how clearly it beat the
+     * next most likely key. Accumulation may continue afterwards.
+     */
+    virtual int finish(double &confidence) = 0;
+
+    /**
+     * Return a value between 0 and 1 indicating how clearly the given
+     * key (1-24) leads every other key in the statistics behind the
+     * most recent key decision, or 0 if it does not lead at all or
+     * key is 0.
+     */
+    virtual double getMargin(int key) const = 0;
+
+    /**
+     * Accumulate a whole mono time-domain buffer, framing it as for
+     * analyse().
+     */
+    void accumulateBuffer(const double *buffer, size_t length);
+    void accumulateBuffer(const float *buffer, size_t length);
+
+    /**
+     * Return the number of bytes of working memory allocated by this
+     * detector and its front end.
+     */
+    virtual size_t getWorkingMemorySize() const = 0;
+
+    /**
+     * Process a whole mono time-domain buffer of the given length,
+     * framing it internally into blocks of getBlockSize() samples
+     * with an advance of getHopSize() between them. Blocks are read
+     * in place; only the final, partial block is copied (and padded
+     * with zeros).
+     *
+     * One key index per hop is appended to keys, and 24 key
+     * strengths per hop (laid out as for getKeyStrengths()) are
+     * appended to keyStrengths.
+     *
+     * The default implementation simply calls process() for each
+     * block. Implementations may override this to work across
+     * several hops at once.
+     */
+    virtual void analyse(const double *buffer, size_t length,
+                         std::vector<int> &keys,
+                         std::vector<double> &keyStrengths);
+
+    /**
+     * Process a whole buffer of single-precision input, as for
+     * analyse(const double *, ...).
+     */
+    virtual void analyse(const float *buffer, size_t length,
+                         std::vector<int> &keys,
+                         std::vector<double> &keyStrengths);
+
+    /**
+     * Process a whole buffer as for analyse(), but divide it into
+     * consecutive segments and calculate the chromagram of each
+     * segment on a separate thread, using a front end obtained from
+     * createFrontEnd(). Each segment is preceded by a few hops of
+     * warm-up so that its decimator filter has settled by the time
+     * the segment itself begins. The chroma vectors are then passed
+     * to processChroma() in order on the calling thread.
+     *
+     * The filter state of the detector's own front end is not used
+     * or updated.
+     */
+    void analyseParallel(const double *buffer, size_t length, int threads,
+                         std::vector<int> &keys,
+                         std::vector<double> &keyStrengths);
+
+    void analyseParallel(const float *buffer, size_t length, int threads,
+                         std::vector<int> &keys,
+                         std::vector<double> &keyStrengths);
 
     /**
      * Return a 24-element vector containing the correlation of the
@@ -35,10 +168,52 @@ public:
      * stored key profiles for the 12 major and 12 minor keys, where
      * index 0 is C major and 12 is C minor.
      */
-    virtual std::vector<double> getKeyStrengths() const = 0;
+    std::vector<double> getKeyStrengths() const;
+
+    /**
+     * Write the key strengths as for getKeyStrengths() into an array
+     * of at least 24 values, without allocating.
+     */
+    virtual void getKeyStrengths(double *strengths) const = 0;
 
     virtual int getHopSize() const = 0;
     virtual int getBlockSize() const = 0;
+
+    /**
+     * Return the detector to the state it was in on construction,
+     * clearing all history, without allocating or freeing memory.
+     */
+    virtual void reset() = 0;
+
+    /**
+     * Change the lengths in seconds of the chroma averaging and key
+     * median windows, and reset. Buffers are reallocated only if
+     * their sizes change. If reallocation throws, the detector is
+     * left exactly as it was, neither changed nor reset.
+     */
+    virtual void setWindowLengths(int hpcpAverageWindowLength,
+                                  int medianAverageWindowLength) = 0;
+
+protected:
+    /**
+     * Return (best - runnerUp) / (|best| + |runnerUp|), clamped to
+     * 0-1, or 0 if both are zero.
+     */
+    static double getRelativeMargin(double best, double runnerUp);
+
+private:
+    template <typename T>
+    void accumulateFrames(const T *buffer, size_t length);
+
+    template <typename T>
+    void analyseFrames(const T *buffer, size_t length,
+                       std::vector<int> &keys,
+                       std::vector<double> &keyStrengths);
+
+    template <typename T>
+    void analyseSegments(const T *buffer, size_t length, int threads,
+                         std::vector<int> &keys,
+                         std::vector<double> &keyStrengths);
 };
 
 }
@@ -8,11 +8,11 @@
 */
 
 #include "KeyDetectorQM.h"
+#include "ChromaFrontEnd.h"
+#include "SlidingMedian.h"
+#include "Kernels.h"
 
 #include "maths/MathUtilities.h"
-#include "base/Pitch.h"
-#include "dsp/rateconversion/Decimator.h"
-#include "dsp/chromagram/Chromagram.h"
 
 #include <iostream>
 #include <cstring>
@@ -22,6 +22,9 @@ namespace KD {
 
 static const int kBinsPerOctave = 36;
 
+// Columns in the profile matrix: all major shifts, then all minor
+static const int kProfileColumns = 2 * kBinsPerOctave;
+
 // Chords profile
 static double MajProfile[kBinsPerOctave] = {
     0.0384, 0.0629, 0.0258, 0.0121, 0.0146, 0.0106, 0.0364, 0.0610, 0.0267,
@@ -38,156 +41,431 @@ static double MinProfile[kBinsPerOctave] = {
 };
     
 
+namespace {
+
+struct ProfileTables
+{
+    double profiles[kBinsPerOctave * kProfileColumns];
+    double energy[kProfileColumns];
+
+    ProfileTables();
+};
+
+ProfileTables::ProfileTables()
+{
+    double mMaj = MathUtilities::mean( MajProfile, kBinsPerOctave );
+    double mMin = MathUtilities::mean( MinProfile, kBinsPerOctave );
+
+    double majProfileNorm[kBinsPerOctave];
+    double minProfileNorm[kBinsPerOctave];
+
+    for (int i = 0; i < kBinsPerOctave; i++) {
+        majProfileNorm[i] = MajProfile[i] - mMaj;
+        minProfileNorm[i] = MinProfile[i] - mMin;
+    }
+
+    // Lay out every rotation of the zero-mean profiles so that the
+    // correlation against all 36 shifts of both is a single pass over
+    // the chroma. Row i holds, for each shift k, the major and then
+    // the minor profile value that lines up with chroma bin i. The
+    // Chromagram has the center of C at bin 0, while the major and
+    // minor profiles have the center of C at 1; we want the
+    // correlation for C to come out at 1, so the profiles are shifted
+    // by a further two bins.
+    for (int i = 0; i < kBinsPerOctave; i++) {
+        double *row = profiles + i * kProfileColumns;
+        for (int k = 0; k < kBinsPerOctave; k++) {
+            int p = (i - (k - 2) + kBinsPerOctave) % kBinsPerOctave;
+            row[k] = majProfileNorm[p];
+            row[k + kBinsPerOctave] = minProfileNorm[p];
+        }
+    }
+
+    // Profile energies are summed in the same order as the rotated
+    // profiles are traversed, so the results match a direct
+    // per-shift calculation exactly
+    for (int k = 0; k < kProfileColumns; k++) {
+        double sum = 0.0;
+        for (int i = 0; i < kBinsPerOctave; i++) {
+            double value = profiles[i * kProfileColumns + k];
+            sum += value * value;
+        }
+        energy[k] = sum;
+    }
+}
+
+const ProfileTables &
+getProfileTables()
+{
+    static const ProfileTables tables;
+    return tables;
+}
+
+}
+
 KeyDetectorQM::KeyDetectorQM(Config config) :
     m_hpcpAverage(config.hpcpAverageWindowLength),
     m_medianAverage(config.medianAverageWindowLength),
+    m_precision(config.precision),
+    m_frontEnd(0),
     m_chrPointer(0),
-    m_decimatedBuffer(0),
+    m_chromaBufferSize(0),
+    m_medianWinSize(0),
+    m_arena(config.allocator),
     m_chromaBuffer(0),
+    m_hpcpSum(0),
+    m_globalSum(0),
+    m_globalCount(0),
     m_meanHPCP(0),
+    m_profiles(0),
     m_majCorr(0),
     m_minCorr(0),
-    m_medianFilterBuffer(0),
-    m_sortedBuffer(0)
+    m_median(1)
 {
-    m_decimationFactor = 8;
-        
-    // Chromagram configuration parameters
-    ChromaConfig cconfig;
-    cconfig.normalise = MathUtilities::NormaliseUnitMax;
-    cconfig.FS = config.sampleRate / (double)m_decimationFactor;
-    if (cconfig.FS < 1) {
-        cconfig.FS = 1;
-    }
+    ChromaFrontEnd::Config fconfig(config.sampleRate);
+    fconfig.tuningFrequency = config.tuningFrequency;
+    fconfig.normalise = MathUtilities::NormaliseUnitMax;
+    fconfig.allocator = config.allocator;
+    fconfig.channels = config.channels;
+    fconfig.mixFirst = config.mixFirst;
+    fconfig.mixCount = config.mixCount;
+    fconfig.chromaInput = config.chromaInput;
+
+    // The front end's buffers go in our arena
+    m_frontEnd = new ChromaFrontEnd(fconfig, true);
 
-    // Set C3 (= MIDI #48) as our base:
-    // This implies that key = 1 => Cmaj, key = 12 => Bmaj, key = 13 => Cmin, etc.
-    cconfig.min = Pitch::getFrequencyForPitch(48, 0, config.tuningFrequency);
-    cconfig.max = Pitch::getFrequencyForPitch(96, 0, config.tuningFrequency);
+    // Get calculated parameters from chroma object
+    m_chromaFrameSize = m_frontEnd->getChromaFrameSize();
+    m_chromaHopSize = m_frontEnd->getChromaHopSize();
+
+    // Allocates buffers and resets. The destructor is not called if
+    // the constructor throws
+    try {
+        setWindowLengths(config.hpcpAverageWindowLength,
+                         config.medianAverageWindowLength);
+    } catch (...) {
+        delete m_frontEnd;
+        throw;
+    }
+}
 
-    cconfig.BPO = kBinsPerOctave;
-    cconfig.CQThresh = 0.0054;
+KeyDetectorQM::~KeyDetectorQM()
+{
+    delete m_frontEnd;
+}
 
-    // Chromagram inst.
-    m_chroma = new Chromagram(cconfig);
+void
+KeyDetectorQM::setWindowLengths(int hpcpAverageWindowLength,
+                                int medianAverageWindowLength)
+{
+    double fs = m_frontEnd->getDecimatedSampleRate();
 
-    // Get calculated parameters from chroma object
-    m_chromaFrameSize = m_chroma->getFrameSize();
-    m_chromaHopSize = m_chroma->getHopSize();
+    // Chromagram average and estimated key median filter lengths
+    int chromaBufferSize = (int)ceil
+        (hpcpAverageWindowLength * fs / m_chromaFrameSize);
+    int medianWinSize = (int)ceil
+        (medianAverageWindowLength * fs / m_chromaFrameSize);
+
+    if (chromaBufferSize != m_chromaBufferSize ||
+        medianWinSize != m_medianWinSize) {
+
+        int oldChromaBufferSize = m_chromaBufferSize;
+        int oldMedianWinSize = m_medianWinSize;
+
+        m_chromaBufferSize = chromaBufferSize;
+        m_medianWinSize = medianWinSize;
+        m_median.setLength(medianWinSize);
+
+        try {
+            allocateBuffers();
+        } catch (...) {
+            // The arena keeps its old block when it fails to get a
+            // new one, so laying out the old sizes again allocates
+            // nothing and puts every buffer back where it was
+            m_chromaBufferSize = oldChromaBufferSize;
+            m_medianWinSize = oldMedianWinSize;
+            m_median.setLength(oldMedianWinSize);
+            if (oldChromaBufferSize > 0) {
+                allocateBuffers();
+            }
+            throw;
+        }
+    }
 
-//    std::cerr << "chroma frame size = " << m_ChromaFrameSize << ", decimation factor = " << m_DecimationFactor << " therefore block size = " << getBlockSize() << std::endl;
+    m_hpcpAverage = hpcpAverageWindowLength;
+    m_medianAverage = medianAverageWindowLength;
 
-    // Chromagram average and estimated key median filter lengths
-    m_chromaBufferSize = (int)ceil
-        (m_hpcpAverage * cconfig.FS / m_chromaFrameSize);
-    m_medianWinSize = (int)ceil
-        (m_medianAverage * cconfig.FS / m_chromaFrameSize);
-    
-    // Reset counters
-    m_bufferIndex = 0;
-    m_chromaBufferFilling = 0;
-    m_medianBufferFilling = 0;
+    reset();
+}
 
-    // Spawn objects/arrays
-    m_decimatedBuffer = new double[m_chromaFrameSize];
-    m_chromaBuffer = new double[kBinsPerOctave * m_chromaBufferSize];
+void
+KeyDetectorQM::allocateBuffers()
+{
+    // Lay out all our buffers, and the front end's, in one block
+    m_arena.clear();
+    m_frontEnd->reserve(m_arena);
+
+    size_t chromaBuffer = m_arena.reserve
+        (getChromaElementSize() * kBinsPerOctave * m_chromaBufferSize);
+    size_t hpcpSum = m_arena.reserve<double>(kBinsPerOctave);
+    size_t globalSum = m_arena.reserve<double>(kBinsPerOctave);
+    size_t meanHPCP = m_arena.reserve<double>(kBinsPerOctave);
+    size_t corr = m_arena.reserve<double>(kProfileColumns);
+    m_median.reserve(m_arena);
+
+    m_arena.commit();
+    m_frontEnd->attach(m_arena);
+
+    m_chromaBuffer = m_arena.get<unsigned char>(chromaBuffer);
+    m_hpcpSum = m_arena.get<double>(hpcpSum);
+    m_globalSum = m_arena.get<double>(globalSum);
+    m_meanHPCP = m_arena.get<double>(meanHPCP);
+    m_majCorr = m_arena.get<double>(corr);
+    m_minCorr = m_majCorr + kBinsPerOctave;
+    m_median.attach(m_arena);
+
+    m_profiles = getProfileMatrix();
+}
 
-    memset(m_chromaBuffer, 0,
-           sizeof(double) * kBinsPerOctave * m_chromaBufferSize);
-    
-    m_meanHPCP = new double[kBinsPerOctave];
-    
-    m_majCorr = new double[kBinsPerOctave];
-    m_minCorr = new double[kBinsPerOctave];
-    
-    m_majProfileNorm = new double[kBinsPerOctave];
-    m_minProfileNorm = new double[kBinsPerOctave];
+const double *
+KeyDetectorQM::getProfileMatrix()
+{
+    return getProfileTables().profiles;
+}
 
-    double mMaj = MathUtilities::mean( MajProfile, kBinsPerOctave );
-    double mMin = MathUtilities::mean( MinProfile, kBinsPerOctave );
+void
+KeyDetectorQM::normaliseCorrelations(const double *meanHPCP,
+                                     double *correlations)
+{
+    const double *profileEnergy = getProfileTables().energy;
 
+    double energy = 0.0;
     for (int i = 0; i < kBinsPerOctave; i++) {
-        m_majProfileNorm[i] = MajProfile[i] - mMaj;
-        m_minProfileNorm[i] = MinProfile[i] - mMin;
+        energy += meanHPCP[i] * meanHPCP[i];
     }
 
-    m_medianFilterBuffer = new int[ m_medianWinSize ];
-    memset( m_medianFilterBuffer, 0, sizeof(int)*m_medianWinSize);
-    
-    m_sortedBuffer = new int[ m_medianWinSize ];
-    memset( m_sortedBuffer, 0, sizeof(int)*m_medianWinSize);
-    
-    m_decimator = new Decimator( m_chromaFrameSize * m_decimationFactor,
-                                 m_decimationFactor );
+    for (int k = 0; k < kProfileColumns; k++) {
+        double den = sqrt(energy * profileEnergy[k]);
+        correlations[k] = (den > 0 ? correlations[k] / den : 0.0);
+    }
 }
 
-KeyDetectorQM::~KeyDetectorQM()
+int
+KeyDetectorQM::getKeyForCorrelations(const double *correlations)
 {
-    delete m_chroma;
-    delete m_decimator;
-    
-    delete [] m_decimatedBuffer;
-    delete [] m_chromaBuffer;
-    delete [] m_meanHPCP;
-    delete [] m_majCorr;
-    delete [] m_minCorr;
-    delete [] m_majProfileNorm;
-    delete [] m_minProfileNorm;
-    delete [] m_medianFilterBuffer;
-    delete [] m_sortedBuffer;
+    // correlations[1] is C center  1 / 3 + 1 = 1
+    // correlations[4] is D center  4 / 3 + 1 = 2
+    // '+ 1' because we number keys 1-24, not 0-23.
+    const double *majCorr = correlations;
+    const double *minCorr = correlations + kBinsPerOctave;
+    double maxMaj;
+    int maxMajBin = MathUtilities::getMax
+        (const_cast<double *>(majCorr), kBinsPerOctave, &maxMaj);
+    double maxMin;
+    int maxMinBin = MathUtilities::getMax
+        (const_cast<double *>(minCorr), kBinsPerOctave, &maxMin);
+    int maxBin = (maxMaj > maxMin) ? maxMajBin : (maxMinBin + kBinsPerOctave);
+    return maxBin / 3 + 1;
 }
 
-double
-KeyDetectorQM::krumCorr(const double *pDataNorm, const double *pProfileNorm, 
-                      int shiftProfile, int length) const
+void
+KeyDetectorQM::getKeyStrengthsForCorrelations(const double *correlations,
+                                              double *keyStrengths)
 {
-    double retVal= 0.0;
-    
-    double num = 0;
-    double den = 0;
-    double sum1 = 0;
-    double sum2 = 0;
-    
-    for (int i = 0; i < length; i++) {
+    // Each key's strength is the best of its three bins
+    for (int k = 0; k < kProfileColumns; k++) {
+        int idx = k / (kBinsPerOctave/12);
+        int rem = k % (kBinsPerOctave/12);
+        if (rem == 0 || correlations[k] > keyStrengths[idx]) {
+            keyStrengths[idx] = correlations[k];
+        }
+    }
+}
+
+
+size_t
+KeyDetectorQM::getChromaElementSize() const
+{
+    switch (m_precision) {
+    case KeyDetector::PRECISION_FLOAT: return sizeof(float);
+    case KeyDetector::PRECISION_FIXED16: return sizeof(unsigned short);
+    default: return sizeof(double);
+    }
+}
 
-        int k = (i - shiftProfile + length) % length;
+void
+KeyDetectorQM::writeChromaFrame(int index, const double *chroma)
+{
+    size_t offset = size_t(index) * kBinsPerOctave * getChromaElementSize();
+    unsigned char *slot = m_chromaBuffer + offset;
 
-        num += pDataNorm[i] * pProfileNorm[k];
+    switch (m_precision) {
 
-        sum1 += (pDataNorm[i] * pDataNorm[i]);
-        sum2 += (pProfileNorm[k] * pProfileNorm[k]);
+    case KeyDetector::PRECISION_FLOAT: {
+        float *out = reinterpret_cast<float *>(slot);
+        for (int k = 0; k < kBinsPerOctave; k++) {
+            out[k] = float(chroma[k]);
+        }
+        break;
     }
-        
-    den = sqrt(sum1 * sum2);
 
-    if (den > 0) {
-        retVal = num/den;
-    } else {
-        retVal = 0;
+    case KeyDetector::PRECISION_FIXED16: {
+        // Our chroma is normalised to unit maximum, so 0-1 maps onto
+        // the full 16-bit range
+        unsigned short *out = reinterpret_cast<unsigned short *>(slot);
+        for (int k = 0; k < kBinsPerOctave; k++) {
+            double v = chroma[k];
+            if (v < 0.0) v = 0.0;
+            if (v > 1.0) v = 1.0;
+            out[k] = (unsigned short)(v * 65535.0 + 0.5);
+        }
+        break;
     }
 
-    return retVal;
+    default:
+        memcpy(slot, chroma, kBinsPerOctave * sizeof(double));
+        break;
+    }
 }
 
-int KeyDetectorQM::process(double *pcmData)
+void
+KeyDetectorQM::readChromaFrame(int index, double *chroma) const
 {
-    int key;
-    int j, k;
+    size_t offset = size_t(index) * kBinsPerOctave * getChromaElementSize();
+    const unsigned char *slot = m_chromaBuffer + offset;
 
-    m_decimator->process(pcmData, m_decimatedBuffer);
+    switch (m_precision) {
 
-    m_chrPointer = m_chroma->process(m_decimatedBuffer);
+    case KeyDetector::PRECISION_FLOAT: {
+        const float *in = reinterpret_cast<const float *>(slot);
+        for (int k = 0; k < kBinsPerOctave; k++) {
+            chroma[k] = in[k];
+        }
+        break;
+    }
 
-    // populate hpcp values
-    int cbidx;
-    for (j = 0;j < kBinsPerOctave;j++ ) {
-        cbidx = (m_bufferIndex * kBinsPerOctave) + j;
-        m_chromaBuffer[ cbidx ] = m_chrPointer[j];
+    case KeyDetector::PRECISION_FIXED16: {
+        const unsigned short *in =
+            reinterpret_cast<const unsigned short *>(slot);
+        for (int k = 0; k < kBinsPerOctave; k++) {
+            chroma[k] = in[k] / 65535.0;
+        }
+        break;
+    }
+
+    default:
+        memcpy(chroma, slot, kBinsPerOctave * sizeof(double));
+        break;
+    }
+}
+
+void
+KeyDetectorQM::reset()
+{
+    m_frontEnd->reset();
+    m_chrPointer = 0;
+
+    // Reset counters
+    m_bufferIndex = 0;
+    m_chromaBufferFilling = 0;
+
+    memset(m_chromaBuffer, 0,
+           getChromaElementSize() * kBinsPerOctave * m_chromaBufferSize);
+    memset(m_hpcpSum, 0, sizeof(double) * kBinsPerOctave);
+    memset(m_globalSum, 0, sizeof(double) * kBinsPerOctave);
+    m_globalCount = 0;
+    memset(m_meanHPCP, 0, sizeof(double) * kBinsPerOctave);
+    memset(m_majCorr, 0, sizeof(double) * kProfileColumns);
+    m_median.reset();
+}
+
+void
+KeyDetectorQM::resumHPCP()
+{
+    memset(m_hpcpSum, 0, sizeof(double) * kBinsPerOctave);
+
+    double frame[kBinsPerOctave];
+
+    for (int j = 0; j < m_chromaBufferSize; j++) {
+        readChromaFrame(j, frame);
+        for (int k = 0; k < kBinsPerOctave; k++) {
+            m_hpcpSum[k] += frame[k];
+        }
+    }
+}
+
+void
+KeyDetectorQM::correlateProfiles()
+{
+    // Accumulate across all shifts of both profiles at once. Each
+    // shift's sum is still formed in bin order. m_minCorr follows
+    // m_majCorr, so this fills both.
+    Kernels::weightedRowSum(m_profiles, m_meanHPCP,
+                            kBinsPerOctave, kProfileColumns, m_majCorr);
+
+    normaliseCorrelations(m_meanHPCP, m_majCorr);
+}
+
+int KeyDetectorQM::process(const double *pcmData)
+{
+    return processChroma(m_frontEnd->process(pcmData));
+}
+
+int KeyDetectorQM::process(const float *pcmData)
+{
+    return processChroma(m_frontEnd->process(pcmData));
+}
+
+int KeyDetectorQM::process(const double *const *channels, int stride)
+{
+    return processChroma(m_frontEnd->process(channels, stride));
+}
+
+int KeyDetectorQM::process(const float *const *channels, int stride)
+{
+    return processChroma(m_frontEnd->process(channels, stride));
+}
+
+ChromaFrontEnd *
+KeyDetectorQM::createFrontEnd() const
+{
+    ChromaFrontEnd::Config fconfig = m_frontEnd->getConfig();
+    fconfig.chromaInput = false;
+    return new ChromaFrontEnd(fconfig);
+}
+
+void
+KeyDetectorQM::normaliseChroma(double *chroma) const
+{
+    // Our history and key profiles assume unit maximum
+    m_frontEnd->normalise(chroma);
+}
+
+int KeyDetectorQM::processChroma(const double *chroma)
+{
+    int key;
+    int j, k;
+
+    m_chrPointer = chroma;
+
+    // populate hpcp values, updating the running sum by removing the
+    // frame being overwritten (zero until the buffer has filled) and
+    // adding the new one as it reads back at our storage precision
+    double outgoing[kBinsPerOctave];
+    double incoming[kBinsPerOctave];
+    readChromaFrame(m_bufferIndex, outgoing);
+    writeChromaFrame(m_bufferIndex, m_chrPointer);
+    readChromaFrame(m_bufferIndex, incoming);
+    for (j = 0; j < kBinsPerOctave; j++) {
+        m_hpcpSum[j] += incoming[j] - outgoing[j];
     }
 
     // keep track of input buffers
     if (m_bufferIndex++ >= m_chromaBufferSize - 1) {
         m_bufferIndex = 0;
+        // Once per trip around the buffer, re-sum it from scratch so
+        // that rounding error in the running sum cannot accumulate
+        resumHPCP();
     }
 
     // track filling of chroma matrix
@@ -197,12 +475,7 @@ int KeyDetectorQM::process(double *pcmData)
 
     // calculate mean
     for (k = 0; k < kBinsPerOctave; k++) {
-        double mnVal = 0.0;
-        for (j = 0; j < m_chromaBufferFilling; j++) {
-            mnVal += m_chromaBuffer[ k + (j * kBinsPerOctave) ];
-        }
-
-        m_meanHPCP[k] = mnVal / (double)m_chromaBufferFilling;
+        m_meanHPCP[k] = m_hpcpSum[k] / (double)m_chromaBufferFilling;
     }
 
     // Normalize for zero average
@@ -211,97 +484,109 @@ int KeyDetectorQM::process(double *pcmData)
         m_meanHPCP[k] -= mHPCP;
     }
 
-    for (k = 0; k < kBinsPerOctave; k++) {
-        // The Chromagram has the center of C at bin 0, while the major
-        // and minor profiles have the center of C at 1. We want to have
-        // the correlation for C result also at 1.
-        // To achieve this we have to shift two times:
-        m_majCorr[k] = krumCorr
-            (m_meanHPCP, m_majProfileNorm, k - 2, kBinsPerOctave);
-        m_minCorr[k] = krumCorr
-            (m_meanHPCP, m_minProfileNorm, k - 2, kBinsPerOctave);
-    }
+    // Correlate against the major and minor profiles at every shift
+    correlateProfiles();
 
-    // m_MajCorr[1] is C center  1 / 3 + 1 = 1
-    // m_MajCorr[4] is D center  4 / 3 + 1 = 2
-    // '+ 1' because we number keys 1-24, not 0-23.
-    double maxMaj;
-    int maxMajBin = MathUtilities::getMax(m_majCorr, kBinsPerOctave, &maxMaj);
-    double maxMin;
-    int maxMinBin = MathUtilities::getMax(m_minCorr, kBinsPerOctave, &maxMin);
-    int maxBin = (maxMaj > maxMin) ? maxMajBin : (maxMinBin + kBinsPerOctave);
-    key = maxBin / 3 + 1;
+    key = getBestKey();
 
     // Median filtering
+    return m_median.push(key);
+}
+
+int
+KeyDetectorQM::getBestKey() const
+{
+    return getKeyForCorrelations(m_majCorr);
+}
+
+void
+KeyDetectorQM::accumulate(const double *pcmData)
+{
+    accumulateChroma(m_frontEnd->process(pcmData));
+}
 
-    // track Median buffer initial filling
-    if (m_medianBufferFilling++ >= m_medianWinSize) {
-        m_medianBufferFilling = m_medianWinSize;
+void
+KeyDetectorQM::accumulate(const float *pcmData)
+{
+    accumulateChroma(m_frontEnd->process(pcmData));
+}
+
+void
+KeyDetectorQM::accumulateChroma(const double *chroma)
+{
+    for (int k = 0; k < kBinsPerOctave; k++) {
+        m_globalSum[k] += chroma[k];
     }
+    ++m_globalCount;
+}
 
-    // shift median buffer
-    for (k = 1; k < m_medianWinSize; k++ ) {
-        m_medianFilterBuffer[ k - 1 ] = m_medianFilterBuffer[ k ];
+int
+KeyDetectorQM::finish(double &confidence)
+{
+    confidence = 0.0;
+    if (m_globalCount == 0) {
+        return 0;
     }
 
-    // write new key value into median buffer
-    m_medianFilterBuffer[ m_medianWinSize - 1 ] = key;
+    for (int k = 0; k < kBinsPerOctave; k++) {
+        m_meanHPCP[k] = m_globalSum[k] / (double)m_globalCount;
+    }
 
-    // copy median into sorting buffer, reversed
-    int ijx = 0;
-    for (k = 0; k < m_medianWinSize; k++) {
-        m_sortedBuffer[k] = m_medianFilterBuffer[m_medianWinSize - 1 - ijx];
-        ijx++;
+    double mHPCP = MathUtilities::mean(m_meanHPCP, kBinsPerOctave);
+    for (int k = 0; k < kBinsPerOctave; k++) {
+        m_meanHPCP[k] -= mHPCP;
     }
 
-    qsort(m_sortedBuffer, m_medianBufferFilling, sizeof(int),
-          MathUtilities::compareInt);
+    correlateProfiles();
 
-    int sortlength = m_medianBufferFilling;
-    int midpoint = (int)ceil((double)sortlength / 2);
+    int key = getBestKey();
+    confidence = getMargin(key);
+    return key;
+}
+
+double
+KeyDetectorQM::getMargin(int key) const
+{
+    if (key < 1 || key > 24) {
+        return 0.0;
+    }
 
-    if (midpoint <= 0) {
-        midpoint = 1;
+    // Each key's strength is the best of its three bins
+    double best = 0.0, runnerUp = 0.0;
+    bool haveRunnerUp = false;
+    for (int k = 0; k < kProfileColumns; k++) {
+        int binKey = k / 3 + 1;
+        double value = m_majCorr[k]; // m_minCorr follows on
+        if (binKey == key) {
+            if (k % 3 == 0 || value > best) best = value;
+        } else if (!haveRunnerUp || value > runnerUp) {
+            runnerUp = value;
+            haveRunnerUp = true;
+        }
     }
 
-    key = m_sortedBuffer[midpoint-1];
+    return getRelativeMargin(best, runnerUp);
+}
 
-    return key;
+size_t
+KeyDetectorQM::getWorkingMemorySize() const
+{
+    return m_arena.getSize();
 }
 
 int
 KeyDetectorQM::getHopSize() const {
-    return m_chromaHopSize * m_decimationFactor;
+    return m_frontEnd->getHopSize();
 }
 
 int
 KeyDetectorQM::getBlockSize() const {
-    return m_chromaFrameSize * m_decimationFactor;
+    return m_frontEnd->getBlockSize();
 }
 
-std::vector<double>
-KeyDetectorQM::getKeyStrengths() const {
-    
-    std::vector<double> keyStrengths;
-    keyStrengths.resize(24, 0.0);
-
-    for (int k = 0; k < kBinsPerOctave; k++) {
-        int idx = k / (kBinsPerOctave/12);
-        int rem = k % (kBinsPerOctave/12);
-        if (rem == 0 || m_majCorr[k] > keyStrengths[idx]) {
-            keyStrengths[idx] = m_majCorr[k];
-        }
-    }
-
-    for (int k = 0; k < kBinsPerOctave; k++) {
-        int idx = (k + kBinsPerOctave) / (kBinsPerOctave/12);
-        int rem = k % (kBinsPerOctave/12);
-        if (rem == 0 || m_minCorr[k] > keyStrengths[idx]) {
-            keyStrengths[idx] = m_minCorr[k];
-        }
-    }
-
-    return keyStrengths;
+void
+KeyDetectorQM::getKeyStrengths(double *keyStrengths) const {
+    getKeyStrengthsForCorrelations(m_majCorr, keyStrengths);
 }
 
 }
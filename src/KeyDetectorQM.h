@@ -11,11 +11,11 @@
 #define KEY_DETECTOR_QM_H
 
 #include "KeyDetectorIface.h"
+#include "keydetector/KeyDetector.h"
+#include "Arena.h"
+#include "SlidingMedian.h"
 #include <vector>
 
-class Decimator;
-class Chromagram;
-
 namespace KD {
 
 class KeyDetectorQM : public KeyDetectorIface
@@ -26,12 +26,28 @@ public:
         double tuningFrequency;
         int hpcpAverageWindowLength;
         int medianAverageWindowLength;
+        KeyDetector::Precision precision;
+        Allocator *allocator;
+
+        // Channel layout of multichannel input and how to mix it
+        // down, and whether only chroma will be supplied; see
+        // ChromaFrontEnd::Config
+        int channels;
+        int mixFirst;
+        int mixCount;
+        bool chromaInput;
 
         Config(double _sampleRate) :
             sampleRate(_sampleRate),
             tuningFrequency(440.0),
             hpcpAverageWindowLength(10),
-            medianAverageWindowLength(10) {
+            medianAverageWindowLength(10),
+            precision(KeyDetector::PRECISION_DOUBLE),
+            allocator(0),
+            channels(1),
+            mixFirst(0),
+            mixCount(1),
+            chromaInput(false) {
         }
     };
     
@@ -47,35 +63,105 @@ public:
      * Return a key index in the range 0-24, where 0 indicates no key
      * detected, 1 is C major, and 13 is C minor.
      */
-    virtual int process(double *frame);
+    virtual int process(const double *frame);
+
+    /**
+     * Process a single-precision frame. The input is decimated in
+     * single precision and only the decimated signal is converted to
+     * double for the chromagram.
+     */
+    virtual int process(const float *frame);
+
+    virtual int process(const double *const *channels, int stride);
+    virtual int process(const float *const *channels, int stride);
+
+    virtual int processChroma(const double *chroma);
+    virtual void normaliseChroma(double *chroma) const;
+
+    /**
+     * Accumulate for a global key estimate. The statistic is simply
+     * the sum of all chroma vectors, which finish() correlates
+     * against the key profiles as process() does with its windowed
+     * mean. This is independent of the state used by process().
+     */
+    virtual void accumulate(const double *frame);
+    virtual void accumulate(const float *frame);
+    virtual void accumulateChroma(const double *chroma);
+
+    /**
+     * Return the key whose profile best correlates with the mean of
+     * all accumulated chroma, with getMargin() of that key as the
+     * confidence. Afterwards getKeyStrengths() returns the
+     * correlations for the accumulated mean.
+     */
+    virtual int finish(double &confidence);
+
+    /**
+     * The margin is the relative difference between the best profile
+     * correlations of the given key and of the best other key.
+     */
+    virtual double getMargin(int key) const;
+
+    virtual ChromaFrontEnd *createFrontEnd() const;
 
     /**
-     * Return a 24-element vector containing the correlation of the
-     * chroma vector generated in the last process() call against the
-     * stored key profiles for the 12 major and 12 minor keys, where
-     * index 0 is C major and 12 is C minor.
+     * Write into keyStrengths the 24 correlations of the chroma
+     * vector generated in the last process() call against the stored
+     * key profiles for the 12 major and 12 minor keys, where index 0
+     * is C major and 12 is C minor.
      */
-    virtual std::vector<double> getKeyStrengths() const;
+    using KeyDetectorIface::getKeyStrengths;
+    virtual void getKeyStrengths(double *keyStrengths) const;
 
     virtual int getHopSize() const;
     virtual int getBlockSize() const;
 
+    virtual size_t getWorkingMemorySize() const;
+
+    virtual void reset();
+    virtual void setWindowLengths(int hpcpAverageWindowLength,
+                                  int medianAverageWindowLength);
+
+    /**
+     * The stages of key estimation that follow the averaging of
+     * chroma, for use by MultiStreamKeyDetector, which runs them for
+     * many streams at once.
+     *
+     * The profile matrix has one row per chroma bin and one column
+     * for each of the 36 shifts of the major profile followed by each
+     * of the 36 shifts of the minor, so that a zero-mean chroma
+     * vector weighting its rows (see Kernels::weightedRowSum) gives
+     * the unnormalised correlation with every shift. Correlations
+     * are laid out the same way throughout.
+     */
+    enum { BinsPerOctave = 36, ProfileColumns = 72 };
+
+    static const double *getProfileMatrix();
+    static void normaliseCorrelations(const double *meanHPCP,
+                                      double *correlations);
+    static int getKeyForCorrelations(const double *correlations);
+    static void getKeyStrengthsForCorrelations(const double *correlations,
+                                               double *keyStrengths);
+
 private:
-    double krumCorr(const double *pDataNorm, const double *pProfileNorm, 
-                    int shiftProfile, int length) const;
+    void allocateBuffers();
+    void resumHPCP();
+    size_t getChromaElementSize() const;
+    void writeChromaFrame(int index, const double *chroma);
+    void readChromaFrame(int index, double *chroma) const;
+
+    void correlateProfiles();
+    int getBestKey() const;
 
     double m_hpcpAverage;
     double m_medianAverage;
-    int m_decimationFactor;
+    KeyDetector::Precision m_precision;
 
-    // Decimator (fixed)
-    Decimator *m_decimator;
-
-    // Chromagram object
-    Chromagram *m_chroma;
+    // Decimator and chromagram
+    ChromaFrontEnd *m_frontEnd;
 
     // Chromagram output pointer
-    double *m_chrPointer;
+    const double *m_chrPointer;
 
     int m_chromaFrameSize;
     int m_chromaHopSize;
@@ -85,18 +171,29 @@ private:
         
     int m_bufferIndex;
     int m_chromaBufferFilling;
-    int m_medianBufferFilling;
 
-    double *m_decimatedBuffer;
-    double *m_chromaBuffer;
+    // Holds all of the buffers below
+    Arena m_arena;
+
+    // History of chroma frames, stored at m_precision
+    unsigned char *m_chromaBuffer;
+    double *m_hpcpSum; // running sum over m_chromaBuffer
+
+    // Sum of all chroma passed to accumulate() since reset()
+    double *m_globalSum;
+    size_t m_globalCount;
     double *m_meanHPCP;
 
-    double *m_majProfileNorm;
-    double *m_minProfileNorm;
+    // Zero-mean major and minor key profiles at every rotation, one
+    // row per chroma bin and one column per profile and shift. These
+    // are constant and shared by all instances.
+    const double *m_profiles;
+
     double *m_majCorr;
-    double *m_minCorr;
-    int *m_medianFilterBuffer;
-    int *m_sortedBuffer;
+    double *m_minCorr; // follows m_majCorr in the same block
+
+    // Median filter over estimated keys; its history is in m_arena
+    SlidingMedian m_median;
 };
 
 }
@@ -0,0 +1,92 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MappedFile.h"
+
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace KD {
+
+MappedFile::MappedFile() :
+    m_data(0),
+    m_size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool
+MappedFile::open(std::string path)
+{
+    close();
+
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = size_t(st.st_size);
+    void *data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping remains valid
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    m_data = static_cast<const unsigned char *>(data);
+    m_size = size;
+#else
+    std::FILE *f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    unsigned char buffer[65536];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        m_copy.insert(m_copy.end(), buffer, buffer + n);
+    }
+    std::fclose(f);
+    if (m_copy.empty()) {
+        return false;
+    }
+    m_data = m_copy.data();
+    m_size = m_copy.size();
+#endif
+
+    return true;
+}
+
+void
+MappedFile::close()
+{
+#ifndef _WIN32
+    if (m_data) {
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+    }
+#else
+    std::vector<unsigned char>().swap(m_copy);
+#endif
+    m_data = 0;
+    m_size = 0;
+}
+
+}
@@ -0,0 +1,53 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_MAPPED_FILE_H
+#define KEY_DETECTOR_MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace KD {
+
+/**
+ * The whole of a file, mapped read-only into memory so that its
+ * pages are loaded only as they are used and are shared with any
+ * other process mapping the same file. Where mapping is unavailable
+ * (on Windows) the file is read into memory instead.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    /**
+     * Map the given file, closing any already open. Return false if
+     * it cannot be opened or is empty.
+     */
+    bool open(std::string path);
+
+    void close();
+
+    const unsigned char *getData() const { return m_data; }
+    size_t getSize() const { return m_size; }
+
+private:
+    const unsigned char *m_data;
+    size_t m_size;
+    std::vector<unsigned char> m_copy;
+
+    MappedFile(const MappedFile &); // not provided
+    MappedFile &operator=(const MappedFile &); // not provided
+};
+
+}
+
+#endif
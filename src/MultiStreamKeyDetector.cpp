@@ -0,0 +1,271 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "keydetector/MultiStreamKeyDetector.h"
+
+#include "KeyDetectorQM.h"
+#include "ChromaFrontEnd.h"
+#include "SlidingMedian.h"
+#include "Kernels.h"
+#include "Arena.h"
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace KD {
+
+static const int kBins = KeyDetectorQM::BinsPerOctave;
+static const int kColumns = KeyDetectorQM::ProfileColumns;
+
+MultiStreamKeyDetector::MultiStreamKeyDetector(KeyDetector::Config config,
+                                               int streams) :
+    m_streams(streams),
+    m_frontEnd(0),
+    m_chromaBufferSize(0),
+    m_bufferIndex(0),
+    m_arena(0),
+    m_chromaBuffer(0),
+    m_hpcpSum(0),
+    m_meanHPCP(0),
+    m_correlations(0),
+    m_filling(0)
+{
+    if (config.method != KeyDetector::METHOD_QM) {
+        throw std::logic_error
+            ("MultiStreamKeyDetector supports METHOD_QM only");
+    }
+    if (streams < 1) {
+        throw std::logic_error("stream count must be at least 1");
+    }
+
+    // The destructor is not called if the constructor throws, so
+    // free whatever has been created if any allocation fails
+    try {
+        // A front end with one decimator chain per stream, as for
+        // per-channel analysis, and the same chroma as KeyDetectorQM
+        ChromaFrontEnd::Config fconfig(config.sampleRate);
+        fconfig.tuningFrequency = config.tuningFrequency;
+        fconfig.normalise = MathUtilities::NormaliseUnitMax;
+        fconfig.allocator = config.allocator;
+        fconfig.channels = streams;
+        fconfig.mixCount = 0;
+        fconfig.planar = true;
+        m_frontEnd = new ChromaFrontEnd(fconfig, true);
+
+        // Window lengths as calculated by KeyDetectorQM
+        double fs = m_frontEnd->getDecimatedSampleRate();
+        int frameSize = m_frontEnd->getChromaFrameSize();
+        m_chromaBufferSize = (int)ceil
+            (config.smoothingWindowLength * fs / frameSize);
+        int medianWinSize = (int)ceil
+            (config.smoothingWindowLength * fs / frameSize);
+
+        m_arena = new Arena(config.allocator);
+        m_frontEnd->reserve(*m_arena);
+
+        size_t chromaBuffer = m_arena->reserve<double>
+            (size_t(streams) * m_chromaBufferSize * kBins);
+        size_t hpcpSum = m_arena->reserve<double>(size_t(streams) * kBins);
+        size_t meanHPCP = m_arena->reserve<double>(size_t(streams) * kBins);
+        size_t correlations = m_arena->reserve<double>
+            (size_t(streams) * kColumns);
+        size_t filling = m_arena->reserve<int>(streams);
+
+        m_medians.reserve(streams);
+        for (int s = 0; s < streams; ++s) {
+            m_medians.push_back(new SlidingMedian(medianWinSize));
+            m_medians[s]->reserve(*m_arena);
+        }
+
+        m_arena->commit();
+        m_frontEnd->attach(*m_arena);
+
+        m_chromaBuffer = m_arena->get<double>(chromaBuffer);
+        m_hpcpSum = m_arena->get<double>(hpcpSum);
+        m_meanHPCP = m_arena->get<double>(meanHPCP);
+        m_correlations = m_arena->get<double>(correlations);
+        m_filling = m_arena->get<int>(filling);
+
+        for (int s = 0; s < streams; ++s) {
+            m_medians[s]->attach(*m_arena);
+        }
+    } catch (...) {
+        for (size_t i = 0; i < m_medians.size(); ++i) {
+            delete m_medians[i];
+        }
+        delete m_frontEnd;
+        delete m_arena;
+        throw;
+    }
+
+    reset();
+}
+
+MultiStreamKeyDetector::~MultiStreamKeyDetector()
+{
+    for (size_t i = 0; i < m_medians.size(); ++i) {
+        delete m_medians[i];
+    }
+    delete m_frontEnd;
+    delete m_arena;
+}
+
+int
+MultiStreamKeyDetector::getBlockSize() const
+{
+    return m_frontEnd->getBlockSize();
+}
+
+int
+MultiStreamKeyDetector::getHopSize() const
+{
+    return m_frontEnd->getHopSize();
+}
+
+void
+MultiStreamKeyDetector::reset()
+{
+    m_frontEnd->reset();
+    m_bufferIndex = 0;
+
+    memset(m_chromaBuffer, 0,
+           sizeof(double) * m_streams * m_chromaBufferSize * kBins);
+    memset(m_hpcpSum, 0, sizeof(double) * m_streams * kBins);
+    memset(m_meanHPCP, 0, sizeof(double) * m_streams * kBins);
+    memset(m_correlations, 0, sizeof(double) * m_streams * kColumns);
+
+    for (int s = 0; s < m_streams; ++s) {
+        m_filling[s] = 0;
+        m_medians[s]->reset();
+    }
+}
+
+void
+MultiStreamKeyDetector::resetStream(int stream)
+{
+    if (stream < 0 || stream >= m_streams) {
+        return;
+    }
+
+    // The front end can only reset all of its decimators at once, so
+    // leave them alone: their state affects only the first block
+    memset(m_chromaBuffer + size_t(stream) * m_chromaBufferSize * kBins, 0,
+           sizeof(double) * m_chromaBufferSize * kBins);
+    memset(m_hpcpSum + stream * kBins, 0, sizeof(double) * kBins);
+    memset(m_meanHPCP + stream * kBins, 0, sizeof(double) * kBins);
+    memset(m_correlations + stream * kColumns, 0, sizeof(double) * kColumns);
+
+    m_filling[stream] = 0;
+    m_medians[stream]->reset();
+}
+
+void
+MultiStreamKeyDetector::process(const double *const *frames, int *keys)
+{
+    processFrames(frames, keys);
+}
+
+void
+MultiStreamKeyDetector::process(const float *const *frames, int *keys)
+{
+    processFrames(frames, keys);
+}
+
+void
+MultiStreamKeyDetector::addChroma(int stream, const double *chroma)
+{
+    double *slot = m_chromaBuffer +
+        (size_t(stream) * m_chromaBufferSize + m_bufferIndex) * kBins;
+    double *sum = m_hpcpSum + stream * kBins;
+
+    for (int j = 0; j < kBins; j++) {
+        sum[j] += chroma[j] - slot[j];
+        slot[j] = chroma[j];
+    }
+}
+
+void
+MultiStreamKeyDetector::resumHPCP()
+{
+    memset(m_hpcpSum, 0, sizeof(double) * m_streams * kBins);
+
+    for (int s = 0; s < m_streams; ++s) {
+        const double *history =
+            m_chromaBuffer + size_t(s) * m_chromaBufferSize * kBins;
+        double *sum = m_hpcpSum + s * kBins;
+        for (int j = 0; j < m_chromaBufferSize; j++) {
+            for (int k = 0; k < kBins; k++) {
+                sum[k] += history[j * kBins + k];
+            }
+        }
+    }
+}
+
+template <typename T>
+void
+MultiStreamKeyDetector::processFrames(const T *const *frames, int *keys)
+{
+    // The streams share the chromagram's output buffer, so each
+    // stream's chroma goes into its history before the next is made
+    for (int s = 0; s < m_streams; ++s) {
+        addChroma(s, m_frontEnd->processChannel(frames, 1, s));
+    }
+
+    // All streams move around their histories together
+    if (m_bufferIndex++ >= m_chromaBufferSize - 1) {
+        m_bufferIndex = 0;
+        resumHPCP();
+    }
+
+    for (int s = 0; s < m_streams; ++s) {
+
+        if (m_filling[s]++ >= m_chromaBufferSize) {
+            m_filling[s] = m_chromaBufferSize;
+        }
+
+        const double *sum = m_hpcpSum + s * kBins;
+        double *mean = m_meanHPCP + s * kBins;
+        for (int k = 0; k < kBins; k++) {
+            mean[k] = sum[k] / (double)m_filling[s];
+        }
+
+        double mHPCP = MathUtilities::mean(mean, kBins);
+        for (int k = 0; k < kBins; k++) {
+            mean[k] -= mHPCP;
+        }
+    }
+
+    // Correlate every stream against every profile shift at once
+    Kernels::weightedRowSums(KeyDetectorQM::getProfileMatrix(), m_meanHPCP,
+                             m_streams, kBins, kColumns, m_correlations);
+
+    for (int s = 0; s < m_streams; ++s) {
+        double *correlations = m_correlations + s * kColumns;
+        KeyDetectorQM::normaliseCorrelations(m_meanHPCP + s * kBins,
+                                             correlations);
+        int key = KeyDetectorQM::getKeyForCorrelations(correlations);
+        keys[s] = m_medians[s]->push(key);
+    }
+}
+
+void
+MultiStreamKeyDetector::getKeyStrengths(int stream, double *strengths) const
+{
+    KeyDetectorQM::getKeyStrengthsForCorrelations
+        (m_correlations + stream * kColumns, strengths);
+}
+
+size_t
+MultiStreamKeyDetector::getWorkingMemorySize() const
+{
+    return m_arena->getSize();
+}
+
+}
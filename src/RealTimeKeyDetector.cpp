@@ -0,0 +1,176 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "keydetector/RealTimeKeyDetector.h"
+#include "FrameRing.h"
+#include "SPSCRing.h"
+
+#include <chrono>
+#include <stdexcept>
+
+namespace KD {
+
+// The worker hands the detector mono blocks from the frame ring, so
+// reject anything else before a detector is built for it
+static KeyDetector::Config
+checkConfig(KeyDetector::Config config)
+{
+    if (config.channels != 1) {
+        throw std::logic_error
+            ("RealTimeKeyDetector supports mono input only");
+    }
+    if (config.chromaInput) {
+        throw std::logic_error
+            ("RealTimeKeyDetector does not support chroma input");
+    }
+    return config;
+}
+
+RealTimeKeyDetector::RealTimeKeyDetector(KeyDetector::Config config,
+                                         double bufferDuration) :
+    m_detector(checkConfig(config)),
+    m_blockSize(m_detector.getBlockSize()),
+    m_hopSize(m_detector.getHopSize()),
+    m_sampleRate(config.sampleRate),
+    m_input(0),
+    m_results(0),
+    m_frames(0),
+    m_running(true),
+    m_samplesPushed(0),
+    m_hopsProcessed(0),
+    m_inputOverruns(0),
+    m_resultOverruns(0),
+    m_lastLatency(0),
+    m_maxLatency(0),
+    m_failed(false)
+{
+    size_t capacity = size_t(bufferDuration * m_sampleRate);
+    if (capacity < size_t(m_blockSize + m_hopSize)) {
+        capacity = m_blockSize + m_hopSize;
+    }
+
+    // The destructor is not called if the constructor throws
+    try {
+        m_input = new SPSCRing<float>(capacity);
+        m_results = new SPSCRing<Result>(capacity / m_hopSize);
+        m_frames = new FrameRing(m_blockSize, m_hopSize);
+        m_scratch.resize(m_hopSize);
+
+        m_worker = std::thread(&RealTimeKeyDetector::run, this);
+    } catch (...) {
+        delete m_frames;
+        delete m_results;
+        delete m_input;
+        throw;
+    }
+}
+
+RealTimeKeyDetector::~RealTimeKeyDetector()
+{
+    m_running.store(false, std::memory_order_release);
+    m_worker.join();
+
+    delete m_frames;
+    delete m_results;
+    delete m_input;
+}
+
+size_t
+RealTimeKeyDetector::push(const float *samples, size_t count)
+{
+    size_t written = m_input->write(samples, count);
+    m_samplesPushed.fetch_add(written, std::memory_order_release);
+    if (written < count) {
+        m_inputOverruns.fetch_add(count - written, std::memory_order_relaxed);
+    }
+    return written;
+}
+
+bool
+RealTimeKeyDetector::getResult(Result &result)
+{
+    return m_results->read(&result, 1) == 1;
+}
+
+RealTimeKeyDetector::Statistics
+RealTimeKeyDetector::getStatistics() const
+{
+    Statistics s;
+    s.samplesPushed = m_samplesPushed.load(std::memory_order_relaxed);
+    s.hopsProcessed = m_hopsProcessed.load(std::memory_order_relaxed);
+    s.inputOverruns = m_inputOverruns.load(std::memory_order_relaxed);
+    s.resultOverruns = m_resultOverruns.load(std::memory_order_relaxed);
+    s.lastLatency = m_lastLatency.load(std::memory_order_relaxed);
+    s.maxLatency = m_maxLatency.load(std::memory_order_relaxed);
+    s.failed = m_failed.load(std::memory_order_acquire);
+    return s;
+}
+
+void
+RealTimeKeyDetector::run()
+{
+    // An exception must not escape the thread, which would terminate
+    // the whole program. Stop and report it instead
+    try {
+        processInput();
+    } catch (...) {
+        m_failed.store(true, std::memory_order_release);
+    }
+}
+
+void
+RealTimeKeyDetector::processInput()
+{
+    // When there is no complete block, wait about half a hop before
+    // looking again
+    std::chrono::microseconds idle
+        (long(500000.0 * m_hopSize / m_sampleRate));
+
+    size_t frame = 0;
+    Result result;
+
+    while (m_running.load(std::memory_order_acquire)) {
+
+        // The frame ring always has room for a hop once its complete
+        // blocks have been consumed
+        size_t count = m_input->read(m_scratch.data(), m_scratch.size());
+        if (count == 0) {
+            std::this_thread::sleep_for(idle);
+            continue;
+        }
+        m_frames->write(m_scratch.data(), count);
+
+        while (m_frames->haveBlock()) {
+
+            result.frame = frame;
+            result.key = m_detector.process(m_frames->getBlock());
+            result.confidence = m_detector.getConfidence();
+            m_detector.getKeyStrengths(result.keyStrengths);
+
+            size_t end = frame + m_blockSize;
+            size_t pushed = m_samplesPushed.load(std::memory_order_acquire);
+            result.latency = (pushed > end ? pushed - end : 0);
+
+            m_lastLatency.store(result.latency, std::memory_order_relaxed);
+            if (result.latency > m_maxLatency.load(std::memory_order_relaxed)) {
+                m_maxLatency.store(result.latency, std::memory_order_relaxed);
+            }
+
+            if (m_results->write(&result, 1) == 0) {
+                m_resultOverruns.fetch_add(1, std::memory_order_relaxed);
+            }
+            m_hopsProcessed.fetch_add(1, std::memory_order_relaxed);
+
+            m_frames->advance();
+            frame += m_hopSize;
+        }
+    }
+}
+
+}
@@ -0,0 +1,124 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_SPSC_RING_H
+#define KEY_DETECTOR_SPSC_RING_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+namespace KD {
+
+/**
+ * Fixed-capacity ring buffer for exactly one writing thread and one
+ * reading thread. Both sides are wait-free: write() and read() never
+ * block, allocate or make system calls, and simply transfer fewer
+ * items than asked if there is not enough space or data.
+ *
+ * The read and write counts increase without wrapping, so the ring
+ * can be filled to its full capacity. Each count is stored only by
+ * its own side and published with release ordering after the items
+ * it covers.
+ */
+template <typename T>
+class SPSCRing
+{
+public:
+    SPSCRing(size_t capacity) :
+        m_capacity(capacity),
+        m_buffer(capacity),
+        m_readCount(0),
+        m_writeCount(0) {
+    }
+
+    size_t getCapacity() const { return m_capacity; }
+
+    /**
+     * Return the number of items available to read. Call from the
+     * reading thread.
+     */
+    size_t getReadSpace() const {
+        return m_writeCount.load(std::memory_order_acquire) -
+            m_readCount.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Return the number of items that may be written. Call from the
+     * writing thread.
+     */
+    size_t getWriteSpace() const {
+        return m_capacity -
+            (m_writeCount.load(std::memory_order_relaxed) -
+             m_readCount.load(std::memory_order_acquire));
+    }
+
+    /**
+     * Append up to count items, returning the number written.
+     */
+    size_t write(const T *items, size_t count) {
+        size_t w = m_writeCount.load(std::memory_order_relaxed);
+        size_t space = m_capacity -
+            (w - m_readCount.load(std::memory_order_acquire));
+        if (count > space) {
+            count = space;
+        }
+        size_t index = w % m_capacity;
+        for (size_t i = 0; i < count; ++i) {
+            m_buffer[index] = items[i];
+            if (++index == m_capacity) {
+                index = 0;
+            }
+        }
+        m_writeCount.store(w + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * Remove up to count items into the given array, returning the
+     * number read.
+     */
+    size_t read(T *items, size_t count) {
+        size_t r = m_readCount.load(std::memory_order_relaxed);
+        size_t available = m_writeCount.load(std::memory_order_acquire) - r;
+        if (count > available) {
+            count = available;
+        }
+        size_t index = r % m_capacity;
+        for (size_t i = 0; i < count; ++i) {
+            items[i] = m_buffer[index];
+            if (++index == m_capacity) {
+                index = 0;
+            }
+        }
+        m_readCount.store(r + count, std::memory_order_release);
+        return count;
+    }
+
+private:
+    const size_t m_capacity;
+    std::vector<T> m_buffer;
+
+    // Kept on separate cache lines so that the two threads do not
+    // contend for the same line on every transfer. Padded rather than
+    // declared alignas(64), because over-aligned types are not
+    // allocated correctly by new before C++17
+    char m_padding0[64];
+    std::atomic<size_t> m_readCount;
+    char m_padding1[64];
+    std::atomic<size_t> m_writeCount;
+    char m_padding2[64];
+
+    SPSCRing(const SPSCRing &); // not provided
+    SPSCRing &operator=(const SPSCRing &); // not provided
+};
+
+}
+
+#endif
@@ -0,0 +1,88 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SlidingMedian.h"
+#include "Arena.h"
+
+#include <cstring>
+
+namespace KD {
+
+SlidingMedian::SlidingMedian(int length) :
+    m_length(0),
+    m_filling(0),
+    m_position(0),
+    m_historyOffset(0),
+    m_history(0)
+{
+    setLength(length);
+    memset(m_counts, 0, sizeof(m_counts));
+}
+
+void
+SlidingMedian::setLength(int length)
+{
+    m_length = (length < 1 ? 1 : length);
+    m_history = 0;
+}
+
+void
+SlidingMedian::reserve(Arena &arena)
+{
+    m_historyOffset = arena.reserve<unsigned char>(m_length);
+}
+
+void
+SlidingMedian::attach(const Arena &arena)
+{
+    m_history = arena.get<unsigned char>(m_historyOffset);
+}
+
+void
+SlidingMedian::reset()
+{
+    m_filling = 0;
+    m_position = 0;
+    memset(m_counts, 0, sizeof(m_counts));
+    memset(m_history, 0, m_length);
+}
+
+int
+SlidingMedian::push(int key)
+{
+    if (key < 0) key = 0;
+    if (key >= KeyCount) key = KeyCount - 1;
+
+    if (m_filling == m_length) {
+        --m_counts[m_history[m_position]];
+    } else {
+        ++m_filling;
+    }
+
+    m_history[m_position] = (unsigned char)key;
+    ++m_counts[key];
+
+    if (++m_position == m_length) {
+        m_position = 0;
+    }
+
+    // Lower median: the element at index ceil(n/2) - 1 in sorted order
+    int rank = (m_filling + 1) / 2 - 1;
+    int seen = 0;
+    for (int k = 0; k < KeyCount; ++k) {
+        seen += m_counts[k];
+        if (seen > rank) {
+            return k;
+        }
+    }
+
+    return 0;
+}
+
+}
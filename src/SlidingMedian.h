@@ -0,0 +1,73 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef KEY_DETECTOR_SLIDING_MEDIAN_H
+#define KEY_DETECTOR_SLIDING_MEDIAN_H
+
+#include <cstddef>
+
+namespace KD {
+
+class Arena;
+
+/**
+ * Median filter over the most recent key estimates. Keys lie in the
+ * range 0-24, so rather than sorting the window on every update we
+ * keep a count of the occurrences of each key within it, and find
+ * the median by walking the 25 counts.
+ *
+ * The result is the lower median of the last min(n, length) keys
+ * pushed, where n is the number pushed since the last reset(). This
+ * is the same value as sorting that window and taking the element at
+ * index ceil(count / 2) - 1.
+ *
+ * The history of keys lives in an arena belonging to the owner,
+ * which must lay it out with reserve() and attach() before the first
+ * call to reset() or push().
+ */
+class SlidingMedian
+{
+public:
+    enum { KeyCount = 25 };
+
+    SlidingMedian(int length);
+
+    /**
+     * Change the window length. The storage must then be laid out
+     * again with reserve() and attach(), followed by reset().
+     */
+    void setLength(int length);
+    int getLength() const { return m_length; }
+
+    void reserve(Arena &arena);
+    void attach(const Arena &arena);
+
+    void reset();
+
+    /**
+     * Add a key (0-24) to the window, dropping the oldest if it is
+     * full, and return the median of the keys now in the window.
+     */
+    int push(int key);
+
+private:
+    int m_length;
+    int m_filling;
+    int m_position;
+    int m_counts[KeyCount];
+    size_t m_historyOffset;
+    unsigned char *m_history; // keys fit in a byte
+
+    SlidingMedian(const SlidingMedian &); // not provided
+    SlidingMedian &operator=(const SlidingMedian &); // not provided
+};
+
+}
+
+#endif
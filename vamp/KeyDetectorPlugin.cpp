@@ -5,10 +5,17 @@ const KD::KeyDetector::Method DefaultMethod = KD::KeyDetector::METHOD_DASCHUER;
 
 const float DefaultTuningFrequency = 440.f;
 
+const KD::KeyDetector::ChannelMode DefaultChannelMode =
+    KD::KeyDetector::CHANNELS_MEAN;
+
+// Enough for 7.1 input
+const size_t MaxChannels = 8;
+
 KeyDetectorPlugin::KeyDetectorPlugin(float inputSampleRate) :
     Plugin(inputSampleRate),
     m_tuningFrequency(DefaultTuningFrequency),
     m_method(DefaultMethod),
+    m_channelMode(DefaultChannelMode),
     m_kd(0),
     m_stepSize(0),
     m_blockSize(0),
@@ -76,9 +83,8 @@ KeyDetectorPlugin::getPreferredBlockSize() const
 {
     if (!m_blockSize) {
         KD::KeyDetector::Config config(m_method, m_inputSampleRate);
-        KD::KeyDetector d(config);
-        m_stepSize = d.getHopSize();
-        m_blockSize = d.getBlockSize();
+        config.tuningFrequency = m_tuningFrequency;
+        KD::KeyDetector::getBlockAndHopSize(config, m_blockSize, m_stepSize);
     }
     return m_blockSize;
 }
@@ -101,7 +107,7 @@ KeyDetectorPlugin::getMinChannelCount() const
 size_t
 KeyDetectorPlugin::getMaxChannelCount() const
 {
-    return 1;
+    return MaxChannels;
 }
 
 KeyDetectorPlugin::ParameterList
@@ -135,6 +141,21 @@ KeyDetectorPlugin::getParameterDescriptors() const
     d.valueNames.clear();
     list.push_back(d);
 
+    d.identifier = "downmix";
+    d.name = "Channel Downmix";
+    d.description = "How to reduce multichannel input to one channel: the mean of all channels, the mean of the first two, or the first channel alone";
+    d.unit = "";
+    d.minValue = (int) KD::KeyDetector::CHANNELS_MEAN;
+    d.maxValue = (int) KD::KeyDetector::CHANNELS_SELECT;
+    d.defaultValue = (int) DefaultChannelMode;
+    d.isQuantized = true;
+    d.quantizeStep = 1;
+    d.valueNames.clear();
+    d.valueNames.push_back("Mean");
+    d.valueNames.push_back("Mid");
+    d.valueNames.push_back("First channel");
+    list.push_back(d);
+
     return list;
 }
 
@@ -147,6 +168,9 @@ KeyDetectorPlugin::getParameter(string identifier) const
     if (identifier == "tuning") {
         return m_tuningFrequency;
     }
+    if (identifier == "downmix") {
+        return (int) m_channelMode;
+    }
     return 0;
 }
 
@@ -163,6 +187,16 @@ KeyDetectorPlugin::setParameter(string identifier, float value)
     }
     if (identifier == "tuning") {
         m_tuningFrequency = value;
+        m_stepSize = m_blockSize = 0; // require re-init
+    }
+    if (identifier == "downmix") {
+        if (value < 0.5) {
+            m_channelMode = KD::KeyDetector::CHANNELS_MEAN;
+        } else if (value < 1.5) {
+            m_channelMode = KD::KeyDetector::CHANNELS_MID;
+        } else if (value < 2.5) {
+            m_channelMode = KD::KeyDetector::CHANNELS_SELECT;
+        }
     }
 }
 
@@ -269,6 +303,8 @@ KeyDetectorPlugin::initialise(size_t channels, size_t stepSize, size_t blockSize
 
     KD::KeyDetector::Config config(m_method, m_inputSampleRate);
     config.tuningFrequency = m_tuningFrequency;
+    config.channels = int(channels);
+    config.channelMode = m_channelMode;
     m_kd = new KD::KeyDetector(config);
 
     m_stepSize = m_kd->getHopSize();
@@ -284,18 +320,15 @@ KeyDetectorPlugin::initialise(size_t channels, size_t stepSize, size_t blockSize
         return false;
     }
 
-    m_inputFrame.resize(m_blockSize, 0.0);
-    
     return true;
 }
 
 void
 KeyDetectorPlugin::reset()
 {
-    delete m_kd;
-    KD::KeyDetector::Config config(m_method, m_inputSampleRate);
-    config.tuningFrequency = m_tuningFrequency;
-    m_kd = new KD::KeyDetector(config);
+    if (m_kd) {
+        m_kd->reset();
+    }
     
     m_prevKey = -1;
 }
@@ -358,11 +391,7 @@ KeyDetectorPlugin::process(const float *const *inputBuffers,
         
     FeatureSet returnFeatures;
 
-    for (int i = 0; i < m_kd->getBlockSize(); ++i) {
-        m_inputFrame[i] = (double)inputBuffers[0][i];
-    }
-
-    int key = m_kd->process(m_inputFrame.data());
+    int key = m_kd->processPlanar(inputBuffers);
     bool minor = (key > 12);
     int tonic = key;
     if (tonic > 12) tonic -= 12;
@@ -415,7 +444,8 @@ KeyDetectorPlugin::process(const float *const *inputBuffers,
 
     Feature ksf;
     ksf.values.reserve(25);
-    std::vector<double> keystrengths = m_kd->getKeyStrengths();
+    double keystrengths[24];
+    m_kd->getKeyStrengths(keystrengths);
     for (int i = 0; i < 24; ++i) {
         if (i == 12) ksf.values.push_back(-1);
         int idx = getKeyIndexForCircleOf5thsIndex(i);
@@ -48,10 +48,10 @@ public:
 protected:
     float m_tuningFrequency;
     KD::KeyDetector::Method m_method;
+    KD::KeyDetector::ChannelMode m_channelMode;
     KD::KeyDetector *m_kd;
     mutable int m_stepSize;
     mutable int m_blockSize;
-    std::vector<double> m_inputFrame;
     int m_prevKey;
 
     int getKeyIndexForCircleOf5thsIndex(int c5) const;